@@ -16,11 +16,18 @@
 #include "StdAfx.h"
 #include "ADFOctree.h"
 #include "Distance.h"
+#include "MorphEngine.h"
+#include "MarchingCubes.h"
+#include "PlaneSets.h"
 #include <fstream>
+#include <algorithm>
+#ifdef OPTIMIZATIONS_SSE
+	#include <xmmintrin.h>
+#endif // OPTIMIZATIONS_SSE
 #include "MemoryManager.h"
 
 namespace{
-	float GetInterpolatedDistance(float distances[8], int i)
+	float GetInterpolatedDistance(const float distances[8], int i)
 	{
 		switch(i){
 			case 0: return (0.5f * (distances[0] + distances[1]));
@@ -59,6 +66,128 @@ namespace{
 			default: ASSERT(false);
 		}
 	}
+	// interleave the bits of the cell coordinates, so that the 3 bits of each level give the index of the child to go
+	inline unsigned int GetMortonCode(int cx, int cy, int cz, int depth)
+	{
+		unsigned int code = 0;
+		for (int i=depth-1;i>=0;--i)
+			code = (code<<3) | ((cx>>i)&1) | (((cy>>i)&1)<<1) | (((cz>>i)&1)<<2);
+		return code;
+	}
+	struct SampleQuery{
+		unsigned int code;
+		int index;
+		bool operator<(const SampleQuery &q) const{return code<q.code;}
+	};
+	// trilinear interpolation of the 8 corners distances at the local coordinates (u,v,w) of the cell,
+	// the gradient (if asked) is given in local coordinates too
+	inline float GetTrilinearDistance(const float distances[8], float u, float v, float w, Point3 *gradient)
+	{
+		// a[] are the distances interpolated along x on the 4 edges (y0z0, y1z0, y0z1, y1z1)
+		// dx[] are the differences of the distances along these edges
+		float a[4], dx[4], d;
+		float weights[4] = {(1.f-v)*(1.f-w), v*(1.f-w), (1.f-v)*w, v*w};
+#ifdef OPTIMIZATIONS_SSE
+		__m128 lo = _mm_loadu_ps(distances);
+		__m128 hi = _mm_loadu_ps(distances+4);
+		__m128 d0 = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2,0,2,0));	// corners 0,2,4,6 (x min)
+		__m128 d1 = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3,1,3,1));	// corners 1,3,5,7 (x max)
+		__m128 mdx = _mm_sub_ps(d1, d0);
+		__m128 ma = _mm_add_ps(d0, _mm_mul_ps(_mm_set1_ps(u), mdx));
+		__m128 mw = _mm_loadu_ps(weights);
+		__m128 sum = _mm_mul_ps(ma, mw);
+		sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+		sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1,1,1,1)));
+		_mm_store_ss(&d, sum);
+		if (!gradient) return d;
+		_mm_storeu_ps(a, ma);
+		_mm_storeu_ps(dx, mdx);
+#else
+		for (int i=0;i<4;++i){
+			dx[i] = distances[2*i+1] - distances[2*i];
+			a[i] = distances[2*i] + u*dx[i];
+		}
+		d = weights[0]*a[0] + weights[1]*a[1] + weights[2]*a[2] + weights[3]*a[3];
+		if (!gradient) return d;
+#endif // OPTIMIZATIONS_SSE
+		gradient->x = weights[0]*dx[0] + weights[1]*dx[1] + weights[2]*dx[2] + weights[3]*dx[3];
+		gradient->y = (1.f-w)*(a[1]-a[0]) + w*(a[3]-a[2]);
+		gradient->z = (1.f-v)*(a[2]-a[0]) + v*(a[3]-a[1]);
+		return d;
+	}
+	// distances stored in a cell: the 8 corners, then in OPTIMIZATIONS_TRIQUADRATIC the 19 samples in the order of GetPoint
+	// (interpolated from the corners if 'distComp' is NULL)
+	inline void GetNodes(const float distances[8], const float *distComp, float nodes[ADF_CELL_NODES])
+	{
+		for (int i=0;i<8;++i)
+			nodes[i] = distances[i];
+#ifdef OPTIMIZATIONS_TRIQUADRATIC
+		for (int i=0;i<19;++i)
+			nodes[8+i] = distComp ? distComp[i] : GetInterpolatedDistance(distances, i);
+#endif // OPTIMIZATIONS_TRIQUADRATIC
+	}
+	// index of the point (x,y,z) of the 3x3x3 grid of a cell (0 min, 1 center, 2 max), at x+3*y+9*z,
+	// in the 8 corners followed by the 19 samples in the order of GetPoint
+	const int gridNodes[27] = {
+		0,  8,  1,  9, 10, 11,  2, 12,  3,
+		13, 14, 15, 16, 17, 18, 19, 20, 21,
+		4, 22,  5, 23, 24, 25,  6, 26,  7};
+	// distance between two boxes (0 if they intersect)
+	inline float GetBoxDistance(const Box3 &a, const Box3 &b)
+	{
+		Point3 amin = a.Min(), amax = a.Max();
+		Point3 bmin = b.Min(), bmax = b.Max();
+		Point3 d(max(0.f, max(amin.x-bmax.x, bmin.x-amax.x)),
+				 max(0.f, max(amin.y-bmax.y, bmin.y-amax.y)),
+				 max(0.f, max(amin.z-bmax.z, bmin.z-amax.z)));
+		return d.Length();
+	}
+	inline bool BoxContains(const Box3 &a, const Box3 &b)
+	{
+		Point3 amin = a.Min(), amax = a.Max();
+		Point3 bmin = b.Min(), bmax = b.Max();
+		return (amin.x<=bmin.x && amin.y<=bmin.y && amin.z<=bmin.z && bmax.x<=amax.x && bmax.y<=amax.y && bmax.z<=amax.z);
+	}
+#ifdef OPTIMIZATIONS_TRIQUADRATIC
+	// triquadratic interpolation of the 27 nodes at the local coordinates (u,v,w) of the cell,
+	// the gradient (if asked) is given in local coordinates too
+	inline float GetTriquadraticDistance(const float nodes[27], float u, float v, float w, Point3 *gradient)
+	{
+		// quadratic Lagrange basis of the nodes at 0, 0.5 and 1, and its derivatives
+		float bu[3] = {2.f*(u-0.5f)*(u-1.f), 4.f*u*(1.f-u), 2.f*u*(u-0.5f)};
+		float bv[3] = {2.f*(v-0.5f)*(v-1.f), 4.f*v*(1.f-v), 2.f*v*(v-0.5f)};
+		float bw[3] = {2.f*(w-0.5f)*(w-1.f), 4.f*w*(1.f-w), 2.f*w*(w-0.5f)};
+		float d = 0.f;
+		if (!gradient){
+			for (int z=0;z<3;++z)
+				for (int y=0;y<3;++y){
+					const int *n = gridNodes+3*y+9*z;
+					d += bv[y]*bw[z]*(bu[0]*nodes[n[0]] + bu[1]*nodes[n[1]] + bu[2]*nodes[n[2]]);
+				}
+			return d;
+		}
+		float du[3] = {4.f*u-3.f, 4.f-8.f*u, 4.f*u-1.f};
+		float dv[3] = {4.f*v-3.f, 4.f-8.f*v, 4.f*v-1.f};
+		float dw[3] = {4.f*w-3.f, 4.f-8.f*w, 4.f*w-1.f};
+		*gradient = Point3(0.f, 0.f, 0.f);
+		for (int z=0;z<3;++z)
+			for (int y=0;y<3;++y){
+				const int *n = gridNodes+3*y+9*z;
+				float a = bu[0]*nodes[n[0]] + bu[1]*nodes[n[1]] + bu[2]*nodes[n[2]];
+				d += bv[y]*bw[z]*a;
+				gradient->x += bv[y]*bw[z]*(du[0]*nodes[n[0]] + du[1]*nodes[n[1]] + du[2]*nodes[n[2]]);
+				gradient->y += dv[y]*bw[z]*a;
+				gradient->z += bv[y]*dw[z]*a;
+			}
+		return d;
+	}
+#endif // OPTIMIZATIONS_TRIQUADRATIC
+	inline int GetTrailingZeros(int v)
+	{
+		int n = 0;
+		while (!(v&1)){v>>=1; ++n;}
+		return n;
+	}
 	void GetPoint(const Point3 &minBox, const Point3 &maxBox, const Point3 &ctrBox, Point3 &p, int i)
 	{
 		switch (i){
@@ -86,7 +215,7 @@ namespace{
 	}
 }
 
-float ADFOctree::GetDistance(const Point3 &p, const std::vector<int> &vec) const
+float ADFOctree::GetDistance(const Mesh *srcMesh, const AveragedNormal *srcNormal, const Point3 &p, const std::vector<int> &vec, Point3 *pseudoNormal, Point3 *closestPoint) const
 {
 	int index1_, index2_, index3_;
 	Point3 dir_, closest_, normal_;
@@ -98,13 +227,13 @@ float ADFOctree::GetDistance(const Point3 &p, const std::vector<int> &vec) const
 	std::vector<int>::const_iterator it;
 
 	for (it=vec.begin(); it!=vec.end(); ++it){
-		int index1 = mesh->faces[*it].getVert(0);
-		int index2 = mesh->faces[*it].getVert(1);
-		int index3 = mesh->faces[*it].getVert(2);
-		p1 =	mesh->verts[index1];
-		p2 =	mesh->verts[index2];
-		p3 =	mesh->verts[index3];
-		normal = avgNormal->faceNormal[*it];
+		int index1 = srcMesh->faces[*it].getVert(0);
+		int index2 = srcMesh->faces[*it].getVert(1);
+		int index3 = srcMesh->faces[*it].getVert(2);
+		p1 =	srcMesh->verts[index1];
+		p2 =	srcMesh->verts[index2];
+		p3 =	srcMesh->verts[index3];
+		normal = srcNormal->faceNormal[*it];
 		closest = GetClosestDistance(p, p1, p2, p3, normal, type);
 		dir = (p-closest);
 		float dist = dir.LengthSquared();
@@ -119,45 +248,193 @@ float ADFOctree::GetDistance(const Point3 &p, const std::vector<int> &vec) const
 	// IF the edgeNormal std::map has not been filled with all the possible pair of edges, the following lines will crash
 	// we could use the operator[] instead of the lower_bound() function but this can't be used on a const std::map
 	switch (type_){
-		case NT_Edge1: normal_ = (*avgNormal->edgeNormal.lower_bound(AveragedNormal::PairOfPoints(index1_, index2_))).second; break;
-		case NT_Edge2: normal_ = (*avgNormal->edgeNormal.lower_bound(AveragedNormal::PairOfPoints(index2_, index3_))).second; break;
-		case NT_Edge3: normal_ = (*avgNormal->edgeNormal.lower_bound(AveragedNormal::PairOfPoints(index1_, index3_))).second; break;
-		case NT_Vertex1: normal_ = avgNormal->verticeNormal[index1_]; break;
-		case NT_Vertex2: normal_ = avgNormal->verticeNormal[index2_]; break;
-		case NT_Vertex3: normal_ = avgNormal->verticeNormal[index3_]; break;
+		case NT_Edge1: normal_ = (*srcNormal->edgeNormal.lower_bound(AveragedNormal::PairOfPoints(index1_, index2_))).second; break;
+		case NT_Edge2: normal_ = (*srcNormal->edgeNormal.lower_bound(AveragedNormal::PairOfPoints(index2_, index3_))).second; break;
+		case NT_Edge3: normal_ = (*srcNormal->edgeNormal.lower_bound(AveragedNormal::PairOfPoints(index1_, index3_))).second; break;
+		case NT_Vertex1: normal_ = srcNormal->verticeNormal[index1_]; break;
+		case NT_Vertex2: normal_ = srcNormal->verticeNormal[index2_]; break;
+		case NT_Vertex3: normal_ = srcNormal->verticeNormal[index3_]; break;
 		case NT_Face: default: break;
 	}
+	if (pseudoNormal) *pseudoNormal = normal_;
+	if (closestPoint) *closestPoint = closest_;
 	return ((dir_%normal_)<0) ? -min_dist : min_dist;
 }
 
+LatticePoint ADFOctree::GetLatticePoint(const Point3 &p) const
+{
+	Point3 coord((p-bbox.Min())/bbox.Width());
+	coord*=(float)(1<<max_depth);
+	return LatticePoint((int)floor(coord.x+0.5f), (int)floor(coord.y+0.5f), (int)floor(coord.z+0.5f));
+}
+
+int ADFOctree::GetCacheBlock(const LatticePoint &lp) const
+{
+	// samples on the boundary of the root can be referenced until the end of the fill
+	int nbCells = 1<<max_depth;
+	if (lp.x<=0 || lp.y<=0 || lp.z<=0 || lp.x>=nbCells || lp.y>=nbCells || lp.z>=nbCells)
+		return 0;
+	// otherwise, the sample lies strictly inside the level-l cell containing it as long as none of its
+	// coordinates is a multiple of the size of that cell: keep it in the block of the deepest such cell,
+	// no cell outside of this one can reference it
+	int shift = max(GetTrailingZeros(lp.x), max(GetTrailingZeros(lp.y), GetTrailingZeros(lp.z)));
+	return max_depth-shift;
+}
+
 int cpt = 0;
 
+void ADFOctree::Clear()
+{
+	Octree<ADFCellValue>::Clear();
+	nbCells = 1;
+#ifdef OPTIMIZATIONS_SHARED_CORNERS
+	corners.Clear();
+#endif // OPTIMIZATIONS_SHARED_CORNERS
+#ifdef OPTIMIZATIONS_BRICKS
+	bricks.clear();
+	brickPool.Clear();
+#endif // OPTIMIZATIONS_BRICKS
+}
+
 void ADFOctree::Fill(const Mesh *mesh_, const AveragedNormal *avgNormal_, const FaceOctree *fOctree_)
 {
 	TIMER(TM_TOTAL);
 
+	// the cells of a previous fill are dropped
+	Clear();
+
 	mesh = mesh_;
 	fOctree = fOctree_;
 	avgNormal = avgNormal_;
 	
 	// fill the root distances values (distances to the mesh from the 8 corners of the bbox)
+	// when the octree is a root of a forest, its corners aren't the corners of the FaceOctree
+	bool bSameBox = (bbox.Min()==fOctree->GetBBox().Min() && bbox.Max()==fOctree->GetBBox().Max());
 	float distances[8];
 	for (int i=0;i<8;++i){
-		const std::vector<int> &vec = fOctree->GetListOfFacesFromCorner(i);
-		distances[i] = signedSqrt(GetDistance(bbox[i], vec));
+		if (bSameBox){
+			const std::vector<int> &vec = fOctree->GetListOfFacesFromCorner(i);
+			distances[i] = signedSqrt(GetDistance(bbox[i], vec));
+		}
+		else
+			distances[i] = ComputeSampleDistance(bbox[i]);
 		// no need to store this distance in the map as it's a corner one,
 		// it will be passed along the octree to the childs
+#ifdef OPTIMIZATIONS_SHARED_CORNERS
+		corners.Set(GetLatticePoint(bbox[i]), distances[i]);
+#endif // OPTIMIZATIONS_SHARED_CORNERS
 	}
 
 	cpt = 0;
 
 	// Recursive call starting at the root node
 	Coordinate c(max_depth);
-	Subdivide(&root, c, distances, bbox, 0, true);
+	if (refinement.budget.IsLimited())
+		FillBestFirst(distances);
+	else
+		Subdivide(&root, c, distances, bbox, 0, true);
+
+	// the samples on the root boundary are the last ones still cached
+	STATS(nbCachedDistances -= (int)mapDistances[0].size();)
+	mapDistances[0].clear();
+	if (streamMC)
+		StreamCell(&root, bbox);
+	else
+		ComputeBounds(&root, bbox);
+
+	OUTPUT_STATS("ADFOctree");
+}
+
+float ADFOctree::ComputeSampleDistance(const Point3 &p, float maxError, float *error, Point3 *pseudoNormal) const
+{
+	if (pseudoNormal) *pseudoNormal = Point3(0.f, 0.f, 0.f);
+	// use the coarsest proxy accurate enough, unless the point is too close to it to trust its sign
+	for (std::vector<ADFProxy>::const_iterator it=proxies.begin(); it!=proxies.end(); ++it){
+		if (it->error>maxError)
+			continue;
+		std::vector<int>listOfFaces;
+		it->fOctree->GetListOfFaces(p, listOfFaces);
+		if (listOfFaces.empty())
+			break;
+		float distance = signedSqrt(GetDistance(it->mesh, it->avgNormal, p, listOfFaces, pseudoNormal));
+		if (abs(distance)<=it->error)
+			break;
+		if (error) *error = it->error;
+		return distance;
+	}
+
+	if (error) *error = 0.f;
+	std::vector<int>listOfFaces;
+	fOctree->GetListOfFaces(p, listOfFaces);
+	ASSERT(listOfFaces.size());
+	return listOfFaces.size()>0 ? signedSqrt(GetDistance(p, listOfFaces, pseudoNormal)) : 0.f;
+}
+
+float ADFOctree::GetSampleDistance(const Point3 &p, const LatticePoint &lp, float maxError, Point3 *pseudoNormal)
+{
+	std::map<LatticePoint, CachedSample> &block = mapDistances[GetCacheBlock(lp)];
+	std::map<LatticePoint, CachedSample>::iterator it = block.find(lp);
+	// the pseudo-normals aren't cached, the sample is computed again when one is needed (only the center of a
+	// cell asks for it, and it is rarely in the cache)
+	if (it!=block.end() && it->second.error<=maxError && !pseudoNormal)
+		return it->second.distance;
+	float error;
+	float distance = ComputeSampleDistance(p, maxError, &error, pseudoNormal);
+	if (it!=block.end())
+		it->second = CachedSample(distance, error);
+	else{
+		block[lp] = CachedSample(distance, error);
+		STATS(++nbCachedDistances; nbPeakCachedDistances = max(nbPeakCachedDistances, nbCachedDistances);)
+	}
+	return distance;
+}
 
-	OUTPUT_STATS("FaceOctree");
+#ifdef OPTIMIZATIONS_BRICKS
+void ADFOctree::FillBrick(const Box3 &curBbox, int level)
+{
+	float *brick = brickPool.Allocate();
+	Point3 minBox = curBbox.Min();
+	Point3 step = curBbox.Width()/(float)BrickPool::BRICK_CELLS;
+	LatticePoint origin(GetLatticePoint(minBox));
+	// a cell of the brick spans several cells of the finest lattice outside of the deepest regions
+	int latticeStep = 1<<(max_depth-level-ADF_BRICK_LEVELS);
+	bool bPositive = false;
+	bool bNegative = false;
+	for (int z=0;z<BrickPool::BRICK_VERTICES;++z){
+		for (int y=0;y<BrickPool::BRICK_VERTICES;++y){
+			for (int x=0;x<BrickPool::BRICK_VERTICES;++x){
+				Point3 p(minBox.x+x*step.x, minBox.y+y*step.y, minBox.z+z*step.z);
+				LatticePoint lp(origin.x+x*latticeStep, origin.y+y*latticeStep, origin.z+z*latticeStep);
+				// the samples on the boundary (or at the center) of the brick may be shared with the neighbours,
+				// the others are only stored in the brick
+				float distance = (GetCacheBlock(lp)<=level+1) ? GetSampleDistance(p, lp) : ComputeSampleDistance(p);
+				brick[BrickPool::GetIndex(x, y, z)] = distance;
+				if (distance<0.f) bNegative = true;
+				else bPositive = true;
+			}
+		}
+	}
+	if (!bPositive || !bNegative){
+		// the surface doesn't cross the brick, the corners of the cell are enough to know its sign
+		brickPool.Release(brick);
+		return;
+	}
+	bricks[origin] = brick;
 }
 
+const float *ADFOctree::GetBrick(const Box3 &cellBox) const
+{
+	LatticePoint pmin(GetLatticePoint(cellBox.Min()));
+	LatticePoint pmax(GetLatticePoint(cellBox.Max()));
+	// a brick holds the cell of its level, not one of its childs or parents sharing its min corner
+	int level = GetBrickLevel(cellBox);
+	if (level<0 || pmax.x-pmin.x!=(1<<(max_depth-level)))
+		return NULL;
+	std::map<LatticePoint, float *>::const_iterator it = bricks.find(pmin);
+	return (it!=bricks.end()) ? it->second : NULL;
+}
+#endif // OPTIMIZATIONS_BRICKS
+
 namespace{
 	bool bAbort=false;
 }
@@ -173,13 +450,18 @@ void ADFOctree::Subdivide(Cell *cell, Coordinate &c, float *distances, const Box
 	}
 
 	float distComp[19];
+	LatticePoint latticeComp[19];
 
-	(*cell)<<ADFCellValue(distances);
+#ifndef OPTIMIZATIONS_SHARED_CORNERS
+	float nodes[ADF_CELL_NODES];
+	GetNodes(distances, NULL, nodes);
+	(*cell)<<ADFCellValue(nodes, curBbox.Width().Length());
+#endif // !OPTIMIZATIONS_SHARED_CORNERS
 
-	if (level==max_depth)
+	if (level>=GetCellMaxDepth(curBbox))
 		return; // stop recursion
 
-	if (!fOctree->HasFaces(c) && bInit){
+	if (!fOctree->HasFaces(curBbox) && bInit){
 		skippedCells.push_back(c);
 		return; // no faces in current cell, so don't subdivide it during initialization
 	}
@@ -189,22 +471,37 @@ void ADFOctree::Subdivide(Cell *cell, Coordinate &c, float *distances, const Box
 	Point3 centerBox = curBbox.Center();
 	Point3 minBox = curBbox.Min();
 	Point3 maxBox = curBbox.Max();
+	float maxError = refinement.proxy_ratio*GetFlatTolerance(curBbox);
+	Point3 centerNormal;
 	for (int i=0; i<19; ++i){
 		GetPoint(minBox, maxBox, centerBox, p, i);
-		MyPoint3 myp(p);
-		std::map<MyPoint3, float>::iterator it = mapDistances.find(myp);
-		if (it==mapDistances.end()){
-			std::vector<int>listOfFaces;
-			fOctree->GetListOfFaces(p, listOfFaces);
-			ASSERT(listOfFaces.size());
-			distComp[i] = listOfFaces.size()>0 ? signedSqrt(GetDistance(p, listOfFaces)) : 0.f;
-			mapDistances[myp] = distComp[i];
-		}
-		else 
-			distComp[i] = it->second;
-	}
-	if (!GetAndCheckInterpDistances(distances, distComp)){
+		LatticePoint &lp = latticeComp[i] = GetLatticePoint(p);
+		distComp[i] = GetSampleDistance(p, lp, maxError, (i==9) ? &centerNormal : NULL);
+	}
+	float tolerance = GetTolerance(distances, distComp[9], &centerNormal, curBbox);
+	bool bSubdivide = !GetAndCheckInterpDistances(distances, distComp, tolerance);
+#ifdef OPTIMIZATIONS_TRIQUADRATIC
+	// the samples are the 19 other nodes of the cell, it isn't split if they are enough to follow the surface
+	GetNodes(distances, distComp, nodes);
+	if (bSubdivide)
+		bSubdivide = !CheckTriquadratic(nodes, curBbox, tolerance, maxError);
+	if (!bSubdivide)
+		(*cell)<<ADFCellValue(nodes, curBbox.Width().Length());
+#endif // OPTIMIZATIONS_TRIQUADRATIC
+#ifdef OPTIMIZATIONS_BRICKS
+	if (bSubdivide && level==GetBrickLevel(curBbox)){
+		FillBrick(curBbox, level);
+		bSubdivide = false;
+	}
+#endif // OPTIMIZATIONS_BRICKS
+	if (bSubdivide){
 		SUBDIVIDE(cell);
+		nbCells += 8;
+#ifdef OPTIMIZATIONS_SHARED_CORNERS
+		// the 19 samples are the corners of the childs, only the samples of the cell corners go in the lattice table
+		for (int i=0;i<19;++i)
+			corners.Set(latticeComp[i], distComp[i]);
+#endif // OPTIMIZATIONS_SHARED_CORNERS
 		Box3 childBox;
 		float childDist[8];
 		for (int i=0;i<8;++i){
@@ -213,19 +510,638 @@ void ADFOctree::Subdivide(Cell *cell, Coordinate &c, float *distances, const Box
 			c.GoDown(i);
 			Subdivide(cell->GetChildPointer(i), c, childDist, childBox, level+1, bInit);
 			c.GoUp();
+			if (streamMC)
+				StreamCell(cell->GetChildPointer(i), childBox);
+		}
+	}
+
+	// every cell able to reference the samples lying inside this one has been processed
+	STATS(nbCachedDistances -= (int)mapDistances[level+1].size();)
+	mapDistances[level+1].clear();
+}
+
+float ADFOctree::GetFlatTolerance(const Box3 &curBbox) const
+{
+	float cellDiagonal = curBbox.Width().Length();
+	// the regions of interest crossing the cell replace the global tolerance by the tightest of theirs
+	float relative_error = -1.f;
+	for (std::vector<RegionOfInterest>::const_iterator it=regions.begin(); it!=regions.end(); ++it){
+		if (it->relative_error>0.f && it->Intersects(curBbox))
+			relative_error = (relative_error<0.f) ? it->relative_error : min(relative_error, it->relative_error);
+	}
+	if (relative_error<0.f)
+		relative_error = refinement.relative_error;
+	return max(relative_error*cellDiagonal, refinement.min_error*bbox.Width().Length());
+}
+
+float ADFOctree::GetTolerance(const float distances[8], float centerDist, const Point3 *centerNormal, const Box3 &curBbox) const
+{
+	Point3 width = curBbox.Width();
+	float cellDiagonal = width.Length();
+	float tolerance = GetFlatTolerance(curBbox);
+	if (refinement.curvature_weight<=0.f || abs(centerDist)>cellDiagonal)
+		return tolerance; // flat criterion, or the surface is too far from the cell to bend inside it
+
+	// compare the pseudo-normal of the closest surface with the gradient of the trilinear interpolation at the center
+	Point3 normal;
+	if (centerNormal)
+		normal = *centerNormal;
+	else{
+		std::vector<int>listOfFaces;
+		fOctree->GetListOfFaces(curBbox.Center(), listOfFaces);
+		normal = Point3(0.f, 0.f, 0.f);
+		if (!listOfFaces.empty())
+			GetDistance(curBbox.Center(), listOfFaces, &normal);
+	}
+	if (normal==Point3(0.f, 0.f, 0.f))
+		return tolerance;
+	Point3 gradient(
+		0.25f*(distances[1]-distances[0]+distances[3]-distances[2]+distances[5]-distances[4]+distances[7]-distances[6])/width.x,
+		0.25f*(distances[2]-distances[0]+distances[3]-distances[1]+distances[6]-distances[4]+distances[7]-distances[5])/width.y,
+		0.25f*(distances[4]-distances[0]+distances[5]-distances[1]+distances[6]-distances[2]+distances[7]-distances[3])/width.z);
+	float lengths = gradient.Length()*normal.Length();
+	float bending = (lengths>0.f) ? 1.f-(gradient%normal)/lengths : 2.f;
+	return tolerance/(1.f+refinement.curvature_weight*bending);
+}
+
+float ADFOctree::GetInterpolationError(float distances[8], float distComp[19]) const
+{
+	float error = 0.f;
+	for (int i=0;i<19;++i)
+		error = max(error, abs(distComp[i] - GetInterpolatedDistance(distances, i)));
+	return error;
+}
+
+void ADFOctree::FillBestFirst(float distances[8])
+{
+	Coordinate c(max_depth);
+	EvaluateCell(&root, c, distances, bbox, 0);
+	RefineOpenCells();
+}
+
+void ADFOctree::RefineOpenCells()
+{
+	const ADFBudget &budget = refinement.budget;
+	DWORD startTime = GetTickCount();
+	while (!openQueue.empty()){
+		if (GetAsyncKeyState(VK_ESCAPE)==1) {
+			MessageBox(0,"ADFOCtree filling aborted by user","Info",MB_OK);
+			bAbort = true;
+			break;
+		}
+		// stop as soon as the next split could exceed the budget
+		if (budget.max_cells>0 && nbCells+8>budget.max_cells)
+			break;
+		if (budget.max_memory>0 && GetMemoryUsage()>((size_t)budget.max_memory<<20))
+			break;
+		if (budget.max_time>0.f && (GetTickCount()-startTime)>(DWORD)(1000.f*budget.max_time))
+			break;
+		int index = openQueue.top().second;
+		openQueue.pop();
+		SplitCell(index);
+	}
+
+	// the cells still open keep the interpolation of their corners
+	openQueue = std::priority_queue<std::pair<float, int> >();
+	openCells.clear();
+	freeOpenCells.clear();
+	for (size_t i=0;i<mapDistances.size();++i){
+		STATS(nbCachedDistances -= (int)mapDistances[i].size();)
+		mapDistances[i].clear();
+	}
+}
+
+void ADFOctree::EvaluateCell(Cell *cell, const Coordinate &c, const float distances[8], const Box3 &curBbox, int level)
+{
+#ifndef OPTIMIZATIONS_SHARED_CORNERS
+	float nodes[ADF_CELL_NODES];
+	GetNodes(distances, NULL, nodes);
+	(*cell)<<ADFCellValue(nodes, curBbox.Width().Length());
+#endif // !OPTIMIZATIONS_SHARED_CORNERS
+
+	if (level>=GetCellMaxDepth(curBbox))
+		return;
+	if (!fOctree->HasFaces(curBbox)){
+		skippedCells.push_back(c);
+		return;
+	}
+
+	// the open cells are spread over the octree, the cache keeps the samples until the end of the refinement
+	// (the budget bounds it) so that the neighbour cells share them
+	OpenCell open(cell, c, curBbox, level);
+	for (int i=0;i<8;++i)
+		open.distances[i] = distances[i];
+	Point3 p;
+	Point3 centerBox = curBbox.Center();
+	Point3 minBox = curBbox.Min();
+	Point3 maxBox = curBbox.Max();
+	float maxError = refinement.proxy_ratio*GetFlatTolerance(curBbox);
+	Point3 centerNormal;
+	for (int i=0; i<19; ++i){
+		GetPoint(minBox, maxBox, centerBox, p, i);
+		open.distComp[i] = GetSampleDistance(p, GetLatticePoint(p), maxError, (i==9) ? &centerNormal : NULL);
+	}
+	float error = GetInterpolationError(open.distances, open.distComp);
+	float tolerance = GetTolerance(open.distances, open.distComp[9], &centerNormal, curBbox);
+#ifdef OPTIMIZATIONS_TRIQUADRATIC
+	GetNodes(open.distances, open.distComp, nodes);
+	if (error<=tolerance || CheckTriquadratic(nodes, curBbox, tolerance, maxError)){
+		(*cell)<<ADFCellValue(nodes, curBbox.Width().Length());
+		return;
+	}
+#else // !OPTIMIZATIONS_TRIQUADRATIC
+	if (error<=tolerance)
+		return;
+#endif // !OPTIMIZATIONS_TRIQUADRATIC
+
+	int index;
+	if (freeOpenCells.empty()){
+		index = (int)openCells.size();
+		openCells.push_back(open);
+	}
+	else{
+		index = freeOpenCells.back();
+		freeOpenCells.pop_back();
+		openCells[index] = open;
+	}
+	openQueue.push(std::make_pair((tolerance>0.f) ? error/tolerance : error, index));
+}
+
+void ADFOctree::SplitCell(int index)
+{
+	OpenCell open(openCells[index]);
+	freeOpenCells.push_back(index);
+	if (splitLog)
+		splitLog->push_back(std::make_pair(open.cell, open.box));
+
+#ifdef OPTIMIZATIONS_BRICKS
+	if (open.level==GetBrickLevel(open.box)){
+		FillBrick(open.box, open.level);
+		return;
+	}
+#endif // OPTIMIZATIONS_BRICKS
+
+	SUBDIVIDE(open.cell);
+	nbCells += 8;
+	Point3 centerBox = open.box.Center();
+	Point3 minBox = open.box.Min();
+	Point3 maxBox = open.box.Max();
+#ifdef OPTIMIZATIONS_SHARED_CORNERS
+	// the 19 samples are the corners of the childs, keep them in the lattice table
+	Point3 p;
+	for (int i=0;i<19;++i){
+		GetPoint(minBox, maxBox, centerBox, p, i);
+		corners.Set(GetLatticePoint(p), open.distComp[i]);
+	}
+#endif // OPTIMIZATIONS_SHARED_CORNERS
+	Box3 childBox;
+	float childDist[8];
+	for (int i=0;i<8;++i){
+		GetChildBox(open.box, childBox, i);
+		GetChildDist(open.distances, open.distComp, childDist, i);
+		open.c.GoDown(i);
+		EvaluateCell(open.cell->GetChildPointer(i), open.c, childDist, childBox, open.level+1);
+		open.c.GoUp();
+	}
+}
+
+void ADFOctree::Update(const std::vector<Box3> &movedBoxes)
+{
+	TIMER(TM_TOTAL);
+
+	if (movedBoxes.empty())
+		return;
+	// UpdateCell sets the bounds along the paths it changed, the cells split afterwards set them up to the root
+	Coordinate c(max_depth);
+	UpdateCell(&root, c, bbox, 0, movedBoxes);
+	if (refinement.budget.IsLimited()){
+		std::vector<std::pair<Cell *, Box3> > splits;
+		splitLog = &splits;
+		RefineOpenCells();
+		splitLog = NULL;
+		for (std::vector<std::pair<Cell *, Box3> >::const_iterator it=splits.begin(); it!=splits.end(); ++it){
+			ComputeBounds(it->first, it->second);
+			PropagateBounds(it->first, it->second);
+		}
+	}
+
+	// the cached samples are only valid for this position of the mesh
+	for (int i=0;i<=max_depth;++i){
+		STATS(nbCachedDistances -= (int)mapDistances[i].size();)
+		mapDistances[i].clear();
+	}
+}
+
+bool ADFOctree::UpdateCell(Cell *cell, Coordinate &c, const Box3 &curBbox, int level, const std::vector<Box3> &movedBoxes)
+{
+	// the distance anywhere in the cell is at most the one of a corner plus the diagonal: a moved face farther
+	// than that is not the closest face of any point of the cell, neither before nor after the move
+	float distances[8];
+	GetCellDistances(cell, curBbox, distances);
+	float reach = 0.f;
+	for (int i=0;i<8;++i)
+		reach = max(reach, abs(distances[i]));
+	reach += curBbox.Width().Length();
+	std::vector<Box3> nearBoxes;
+	for (std::vector<Box3>::const_iterator it=movedBoxes.begin(); it!=movedBoxes.end(); ++it){
+		if (GetBoxDistance(curBbox, *it)<=reach)
+			nearBoxes.push_back(*it);
+	}
+	if (nearBoxes.empty())
+		return false;
+
+	if (!cell->GetChildPointer(0)){
+		// sample the corners again and refine the leaf from scratch
+#ifdef OPTIMIZATIONS_BRICKS
+		if (level==GetBrickLevel(curBbox)){
+			std::map<LatticePoint, float *>::iterator it = bricks.find(GetLatticePoint(curBbox.Min()));
+			if (it!=bricks.end()){
+				brickPool.Release(it->second);
+				bricks.erase(it);
+			}
+		}
+#endif // OPTIMIZATIONS_BRICKS
+		for (int i=0;i<8;++i){
+			LatticePoint lp(GetLatticePoint(curBbox[i]));
+			distances[i] = GetSampleDistance(curBbox[i], lp);
+#ifdef OPTIMIZATIONS_SHARED_CORNERS
+			corners.Set(lp, distances[i]);
+#endif // OPTIMIZATIONS_SHARED_CORNERS
 		}
+		if (refinement.budget.IsLimited())
+			EvaluateCell(cell, c, distances, curBbox, level);
+		else
+			Subdivide(cell, c, distances, curBbox, level, true);
+		ComputeBounds(cell, curBbox);
+		return true;
+	}
+
+	bool bChanged = false;
+	Box3 childBox;
+	for (int i=0;i<8;++i){
+		GetChildBox(curBbox, childBox, i);
+		c.GoDown(i);
+		if (UpdateCell(cell->GetChildPointer(i), c, childBox, level+1, nearBoxes))
+			bChanged = true;
+		c.GoUp();
+	}
+
+	if (bChanged){
+		// the corners of the childs are the corners and the 19 samples of the cell
+		float distComp[19];
+		float childDist[8];
+		bool bLeaves = true;
+		for (int i=0;i<8;++i){
+			Cell *child = cell->GetChildPointer(i);
+			GetChildBox(curBbox, childBox, i);
+			GetCellDistances(child, childBox, childDist);
+			int origin = (i&1) + 3*((i>>1)&1) + 9*((i>>2)&1);
+			for (int j=0;j<8;++j){
+				int node = gridNodes[origin + (j&1) + 3*((j>>1)&1) + 9*((j>>2)&1)];
+				if (node<8)
+					distances[node] = childDist[j];
+				else
+					distComp[node-8] = childDist[j];
+			}
+			if (child->GetChildPointer(0))
+				bLeaves = false;
+			OPT_BRICKS(if (GetBrick(childBox)) bLeaves = false;)
+		}
+#ifndef OPTIMIZATIONS_SHARED_CORNERS
+		float nodes[ADF_CELL_NODES];
+		GetNodes(distances, distComp, nodes);
+		(*cell)<<ADFCellValue(nodes, curBbox.Width().Length());
+#endif // !OPTIMIZATIONS_SHARED_CORNERS
+		// merge the childs back if the cell is refined enough without them (the open cells of the best-first
+		// refinement may still be waiting to be split, they are kept)
+		if (bLeaves && !refinement.budget.IsLimited() &&
+			GetAndCheckInterpDistances(distances, distComp, GetTolerance(distances, distComp[9], NULL, curBbox))){
+			CollapseCell(cell);
+			nbCells -= 8;
+		}
+		if (cell->GetChildPointer(0))
+			MergeChildBounds(cell, curBbox);
+		else
+			ComputeBounds(cell, curBbox);
+	}
+
+	// every cell able to reference the samples lying inside this one has been processed
+	STATS(nbCachedDistances -= (int)mapDistances[level+1].size();)
+	mapDistances[level+1].clear();
+	return bChanged;
+}
+
+size_t ADFOctree::GetMemoryUsage() const
+{
+	size_t memory = nbCells*sizeof(Cell);
+	memory += openCells.capacity()*(sizeof(OpenCell)+max_depth*sizeof(Coordinate::dbyte));
+	memory += openQueue.size()*sizeof(std::pair<float, int>);
+#ifdef OPTIMIZATIONS_SHARED_CORNERS
+	memory += corners.GetMemoryUsage();
+#endif // OPTIMIZATIONS_SHARED_CORNERS
+#ifdef OPTIMIZATIONS_BRICKS
+	memory += brickPool.GetMemoryUsage();
+#endif // OPTIMIZATIONS_BRICKS
+	return memory;
+}
+
+#ifdef OPTIMIZATIONS_TRIQUADRATIC
+bool ADFOctree::CheckTriquadratic(const float nodes[27], const Box3 &curBbox, float tolerance, float maxError)
+{
+	Point3 minBox = curBbox.Min();
+	Point3 width = curBbox.Width();
+	for (int i=0;i<8;++i){
+		float u = (i&1) ? 0.75f : 0.25f;
+		float v = (i&2) ? 0.75f : 0.25f;
+		float w = (i&4) ? 0.75f : 0.25f;
+		Point3 p(minBox.x+u*width.x, minBox.y+v*width.y, minBox.z+w*width.z);
+		float distance = ComputeSampleDistance(p, maxError);
+		if (abs(distance - GetTriquadraticDistance(nodes, u, v, w, NULL))>tolerance)
+			return false;
 	}
+	return true;
+}
+
+void ADFOctree::GetOctantDistances(const float nodes[27], int i, float distances[8])
+{
+	int origin = (i&1) + 3*((i>>1)&1) + 9*((i>>2)&1);
+	for (int j=0;j<8;++j)
+		distances[j] = nodes[gridNodes[origin + (j&1) + 3*((j>>1)&1) + 9*((j>>2)&1)]];
 }
+#endif // OPTIMIZATIONS_TRIQUADRATIC
 
-bool ADFOctree::GetAndCheckInterpDistances(float distances[8], float distComp[19]) const
+bool ADFOctree::GetAndCheckInterpDistances(float distances[8], float distComp[19], float tolerance) const
 {
 	for (int i=0;i<19;++i){
-		if (abs(distComp[i] - GetInterpolatedDistance(distances, i))>min_error)
+		if (abs(distComp[i] - GetInterpolatedDistance(distances, i))>tolerance)
 			return false;	
 	}
 	return true;
 }
 
+void ADFOctree::GetDistances(const Point3 *points, int nbPoints, float *distances, Point3 *gradients) const
+{
+	ASSERT(max_depth<=10); // the morton codes are stored on 32 bits
+	int nbCells = 1<<max_depth;
+	Point3 minBox = bbox.Min();
+	Point3 scale = Point3((float)nbCells, (float)nbCells, (float)nbCells)/bbox.Width();
+
+	// sort the queries along the Morton curve, so that consecutive queries share most of their path in the octree
+	std::vector<SampleQuery> queries(nbPoints);
+	for (int i=0;i<nbPoints;++i){
+		Point3 coord((points[i]-minBox)*scale);
+		int cx = max(0, min(nbCells-1, (int)floor(coord.x)));
+		int cy = max(0, min(nbCells-1, (int)floor(coord.y)));
+		int cz = max(0, min(nbCells-1, (int)floor(coord.z)));
+		queries[i].code = GetMortonCode(cx, cy, cz, max_depth);
+		queries[i].index = i;
+	}
+	std::sort(queries.begin(), queries.end());
+
+	// path from the root to the current leaf, only the part not shared with the previous query is walked again
+	std::vector<const Cell *> path(max_depth+1);
+	std::vector<Box3> boxes(max_depth+1);
+	path[0] = &root;
+	boxes[0] = bbox;
+	int level = 0;
+	unsigned int curCode = 0;
+	for (std::vector<SampleQuery>::const_iterator it=queries.begin(); it!=queries.end(); ++it){
+		while (level>0 && ((*it).code>>(3*(max_depth-level)))!=(curCode>>(3*(max_depth-level))))
+			--level;
+		while (level<max_depth && path[level]->GetChildPointer(0)){
+			int child = ((*it).code>>(3*(max_depth-level-1)))&7;
+			GetChildBox(boxes[level], boxes[level+1], child);
+			path[level+1] = path[level]->GetChildPointer(child);
+			++level;
+		}
+		curCode = (*it).code;
+
+		// local coordinates of the point in the leaf
+		const Box3 &leafBox = boxes[level];
+		Point3 width = leafBox.Width();
+		Point3 local = (points[(*it).index]-leafBox.Min())/width;
+		float u = max(0.f, min(1.f, local.x));
+		float v = max(0.f, min(1.f, local.y));
+		float w = max(0.f, min(1.f, local.z));
+#ifdef OPTIMIZATIONS_TRIQUADRATIC
+		float nodes[27];
+		GetCellNodes(path[level], leafBox, nodes);
+		if (gradients){
+			Point3 &gradient = gradients[(*it).index];
+			distances[(*it).index] = GetTriquadraticDistance(nodes, u, v, w, &gradient);
+			gradient = gradient/width;
+		}
+		else
+			distances[(*it).index] = GetTriquadraticDistance(nodes, u, v, w, NULL);
+#else // !OPTIMIZATIONS_TRIQUADRATIC
+		float dist[8];
+#ifdef OPTIMIZATIONS_BRICKS
+		const float *brick = GetBrick(leafBox);
+		if (brick){
+			// go down to the cell of the brick containing the point
+			int bx = min(BrickPool::BRICK_CELLS-1, (int)(u*BrickPool::BRICK_CELLS));
+			int by = min(BrickPool::BRICK_CELLS-1, (int)(v*BrickPool::BRICK_CELLS));
+			int bz = min(BrickPool::BRICK_CELLS-1, (int)(w*BrickPool::BRICK_CELLS));
+			u = u*BrickPool::BRICK_CELLS-bx;
+			v = v*BrickPool::BRICK_CELLS-by;
+			w = w*BrickPool::BRICK_CELLS-bz;
+			width /= (float)BrickPool::BRICK_CELLS;
+			BrickPool::GetCellDistances(brick, bx, by, bz, dist);
+		}
+		else
+#endif // OPTIMIZATIONS_BRICKS
+		GetCellDistances(path[level], leafBox, dist);
+		if (gradients){
+			Point3 &gradient = gradients[(*it).index];
+			distances[(*it).index] = GetTrilinearDistance(dist, u, v, w, &gradient);
+			gradient = gradient/width;
+		}
+		else
+			distances[(*it).index] = GetTrilinearDistance(dist, u, v, w, NULL);
+#endif // !OPTIMIZATIONS_TRIQUADRATIC
+	}
+}
+
+void ADFOctree::GetCellDistances(const Cell *cell, const Box3 &cellBox, float distances[8]) const
+{
+#ifdef OPTIMIZATIONS_SHARED_CORNERS
+	LatticePoint pmin(GetLatticePoint(cellBox.Min()));
+	LatticePoint pmax(GetLatticePoint(cellBox.Max()));
+	for (int i=0;i<8;++i)
+		distances[i] = corners.Get(LatticePoint((i&1) ? pmax.x : pmin.x, (i&2) ? pmax.y : pmin.y, (i&4) ? pmax.z : pmin.z));
+#elif defined(OPTIMIZATIONS_TRIQUADRATIC)
+	float nodes[27];
+	cell->GetValue()->Decode(nodes, cellBox.Width().Length());
+	for (int i=0;i<8;++i)
+		distances[i] = nodes[i];
+#else // !OPTIMIZATIONS_SHARED_CORNERS && !OPTIMIZATIONS_TRIQUADRATIC
+	cell->GetValue()->Decode(distances, cellBox.Width().Length());
+#endif // !OPTIMIZATIONS_SHARED_CORNERS && !OPTIMIZATIONS_TRIQUADRATIC
+}
+
+bool ADFOctree::GetHermiteData(const Point3 &p, Point3 &closest, Point3 &normal) const
+{
+	if (!mesh || !fOctree)
+		return false;
+	std::vector<int>listOfFaces;
+	fOctree->GetListOfFaces(p, listOfFaces);
+	if (listOfFaces.empty())
+		return false;
+	GetDistance(p, listOfFaces, &normal, &closest);
+	normal = normal.Normalize();
+	return true;
+}
+
+void ADFOctree::ComputeBounds(Cell *cell, const Box3 &curBbox)
+{
+	if (cell->GetChildPointer(0)){
+		Box3 childBox;
+		for (int i=0;i<8;++i){
+			GetChildBox(curBbox, childBox, i);
+			ComputeBounds(cell->GetChildPointer(i), childBox);
+		}
+		MergeChildBounds(cell, curBbox);
+		return;
+	}
+#ifdef OPTIMIZATIONS_BRICKS
+	const float *brick = GetBrick(curBbox);
+	if (brick){
+		float lo = brick[0], hi = brick[0];
+		for (int i=1;i<BrickPool::BRICK_SIZE;++i){
+			lo = min(lo, brick[i]);
+			hi = max(hi, brick[i]);
+		}
+		cell->GetValue()->bounds.Set(lo, hi, curBbox.Width().Length());
+		return;
+	}
+#endif // OPTIMIZATIONS_BRICKS
+#ifdef OPTIMIZATIONS_TRIQUADRATIC
+	float nodes[27];
+	GetCellNodes(cell, curBbox, nodes);
+	float lo = nodes[0], hi = nodes[0];
+	for (int i=1;i<27;++i){
+		lo = min(lo, nodes[i]);
+		hi = max(hi, nodes[i]);
+	}
+	// the quadratic basis isn't positive, the interpolation can leave the range of the nodes by up to
+	// its Lebesgue constant (1.25 per axis) times the half range
+	float center = 0.5f*(lo+hi);
+	float radius = 0.5f*(hi-lo)*1.25f*1.25f*1.25f;
+	cell->GetValue()->bounds.Set(center-radius, center+radius, curBbox.Width().Length());
+#else // !OPTIMIZATIONS_TRIQUADRATIC
+	// the trilinear interpolation stays between the corners
+	float distances[8];
+	GetCellDistances(cell, curBbox, distances);
+	float lo = distances[0], hi = distances[0];
+	for (int i=1;i<8;++i){
+		lo = min(lo, distances[i]);
+		hi = max(hi, distances[i]);
+	}
+	cell->GetValue()->bounds.Set(lo, hi, curBbox.Width().Length());
+#endif // !OPTIMIZATIONS_TRIQUADRATIC
+}
+
+void ADFOctree::MergeChildBounds(Cell *cell, const Box3 &curBbox)
+{
+	float diagonal = curBbox.Width().Length();
+	float lo = 1e30f, hi = -1e30f;
+	for (int i=0;i<8;++i){
+		float childLo, childHi;
+		cell->GetChildPointer(i)->GetValue()->bounds.Get(childLo, childHi, 0.5f*diagonal);
+		lo = min(lo, childLo);
+		hi = max(hi, childHi);
+	}
+	cell->GetValue()->bounds.Set(lo, hi, diagonal);
+}
+
+void ADFOctree::PropagateBounds(Cell *cell, Box3 curBbox)
+{
+	for (Cell *parent=cell->GetParent(); parent; cell=parent, parent=parent->GetParent()){
+		int i = 0;
+		while (parent->GetChildPointer(i)!=cell) ++i;
+		Point3 width = curBbox.Width();
+		Point3 parentMin = curBbox.Min();
+		if (i&1) parentMin.x -= width.x;
+		if (i&2) parentMin.y -= width.y;
+		if (i&4) parentMin.z -= width.z;
+		curBbox = Box3(parentMin, parentMin+2.f*width);
+		MergeChildBounds(parent, curBbox);
+	}
+}
+
+void ADFOctree::FillAndPolygonize(const Mesh *mesh_, const AveragedNormal *avgNormal_, const FaceOctree *fOctree_,
+								  MarchingCube &MC, Poly *&plist_ptr, bool bKeepOctree)
+{
+	if (refinement.budget.IsLimited()){
+		Fill(mesh_, avgNormal_, fOctree_);
+		MC.ComputeMCInOctree(this, plist_ptr);
+		return;
+	}
+	streamMC = &MC;
+	streamPolys = &plist_ptr;
+	bStreamDiscard = !bKeepOctree;
+	Fill(mesh_, avgNormal_, fOctree_);
+	streamMC = NULL;
+	streamPolys = NULL;
+	bStreamDiscard = false;
+}
+
+void ADFOctree::StreamCell(Cell *cell, const Box3 &curBbox)
+{
+	if (!cell->GetChildPointer(0)){
+		// the polygonization skips the cells whose bounds have a single sign, they are set first
+		ComputeBounds(cell, curBbox);
+		streamMC->ComputeMCInOctreeLeaf(this, cell, curBbox, *streamPolys);
+#ifdef OPTIMIZATIONS_BRICKS
+		if (bStreamDiscard && GetBrick(curBbox)){
+			std::map<LatticePoint, float *>::iterator it = bricks.find(GetLatticePoint(curBbox.Min()));
+			brickPool.Release(it->second);
+			bricks.erase(it);
+		}
+#endif // OPTIMIZATIONS_BRICKS
+		return;
+	}
+	// the childs were streamed already, their bounds are set
+	MergeChildBounds(cell, curBbox);
+	if (bStreamDiscard){
+		CollapseCell(cell);
+		nbCells -= 8;
+	}
+}
+
+void ADFOctree::GetDistanceBounds(const Cell *cell, const Box3 &cellBox, const Box3 &box, float &minDist, float &maxDist) const
+{
+	if (GetBoxDistance(cellBox, box)>0.f)
+		return;
+	if (cell->GetChildPointer(0) && !BoxContains(box, cellBox)){
+		Box3 childBox;
+		for (int i=0;i<8;++i){
+			GetChildBox(cellBox, childBox, i);
+			GetDistanceBounds(cell->GetChildPointer(i), childBox, box, minDist, maxDist);
+		}
+		return;
+	}
+	float lo, hi;
+	cell->GetValue()->bounds.Get(lo, hi, cellBox.Width().Length());
+	minDist = min(minDist, lo);
+	maxDist = max(maxDist, hi);
+}
+
+bool ADFOctree::GetDistanceBounds(const Box3 &box, float &minDist, float &maxDist) const
+{
+	if (GetBoxDistance(bbox, box)>0.f)
+		return false;
+	GetDistanceBounds(&root, bbox, box, minDist, maxDist);
+	return true;
+}
+
+#ifdef OPTIMIZATIONS_TRIQUADRATIC
+void ADFOctree::GetCellNodes(const Cell *cell, const Box3 &cellBox, float nodes[27]) const
+{
+	cell->GetValue()->Decode(nodes, cellBox.Width().Length());
+}
+#endif // OPTIMIZATIONS_TRIQUADRATIC
+
 #ifdef DISPLAY_MORPH_ENGINE
 void ADFOctree::Display(GraphicsWindow *gw) const
 {
@@ -235,7 +1151,252 @@ void ADFOctree::Display(GraphicsWindow *gw) const
 }
 #endif // DISPLAY_MORPH_ENGINE
 
-extern std::ostream &operator<<(std::ostream &o, const ADFOctree&)
+ADFForest::ADFForest(const Box3 &bbox_, int max_roots, int max_depth, const ADFRefinement &refinement, int symmetryAxis, float symmetryPlane)
+	: symmetryAxis(symmetryAxis), symmetryPlane(symmetryPlane)
+{
+	// a symmetric forest only tiles the half of the box above the plane of symmetry
+	Box3 bbox(bbox_);
+	if (symmetryAxis>=0){
+		Point3 halfMin = bbox.Min();
+		halfMin[symmetryAxis] = symmetryPlane;
+		bbox = Box3(halfMin, bbox.Max());
+	}
+
+	// the roots are as small as the shortest side of the box allows, within the max_roots budget.
+	// k roots along the longest side keep one cell of the finest level of margin, like a single
+	// octree does (InitBox), so a single root has the size of the box of the FaceOctree
+	Point3 width = bbox.Width();
+	float maxWidth = max(width.x, max(width.y, width.z));
+	float minWidth = max(min(width.x, min(width.y, width.z)), 1e-6f*maxWidth);
+	float cellRatio = 1.f/(float)(1<<max_depth);
+	int k = max(1, max_roots);
+	for (;;--k){
+		rootSize = max(maxWidth/((float)k-cellRatio), minWidth/(1.f-cellRatio));
+		for (int i=0;i<3;++i)
+			nbRoots[i] = max(1, (int)ceil(width[i]/rootSize+cellRatio-1e-4f));
+		if (k==1 || nbRoots[0]*nbRoots[1]*nbRoots[2]<=max(1, max_roots))
+			break;
+	}
+	Point3 forestWidth((float)nbRoots[0]*rootSize, (float)nbRoots[1]*rootSize, (float)nbRoots[2]*rootSize);
+	origin = bbox.Center()-0.5f*forestWidth;
+	// the roots start exactly on the plane of symmetry, so that the reflected field and surface match it
+	if (symmetryAxis>=0)
+		origin[symmetryAxis] = symmetryPlane;
+
+	// the budget of the refinement is shared between the roots
+	int n = nbRoots[0]*nbRoots[1]*nbRoots[2];
+	ADFRefinement rootRefinement(refinement);
+	ADFBudget &budget = rootRefinement.budget;
+	if (budget.max_cells>0) budget.max_cells = max(9, budget.max_cells/n);
+	if (budget.max_memory>0) budget.max_memory = max(1, budget.max_memory/n);
+	budget.max_time /= (float)n;
+
+	// the common faces of two roots are computed with the same expression, so they match exactly
+	for (int z=0;z<nbRoots[2];++z){
+		for (int y=0;y<nbRoots[1];++y){
+			for (int x=0;x<nbRoots[0];++x){
+				Point3 rootMin(origin.x+(float)x*rootSize, origin.y+(float)y*rootSize, origin.z+(float)z*rootSize);
+				Point3 rootMax(origin.x+(float)(x+1)*rootSize, origin.y+(float)(y+1)*rootSize, origin.z+(float)(z+1)*rootSize);
+				roots.push_back(new ADFOctree(Box3(rootMin, rootMax), max_depth, rootRefinement));
+			}
+		}
+	}
+}
+
+ADFForest::~ADFForest()
+{
+	for (std::vector<ADFOctree *>::iterator it=roots.begin(); it!=roots.end(); ++it)
+		delete (*it);
+	roots.clear();
+}
+
+void ADFForest::SetRegionsOfInterest(const std::vector<RegionOfInterest> &regions, int base_depth)
+{
+	for (std::vector<ADFOctree *>::iterator it=roots.begin(); it!=roots.end(); ++it)
+		(*it)->SetRegionsOfInterest(regions, base_depth);
+}
+
+void ADFForest::SetProxies(const std::vector<ADFProxy> &proxies)
+{
+	for (std::vector<ADFOctree *>::iterator it=roots.begin(); it!=roots.end(); ++it)
+		(*it)->SetProxies(proxies);
+}
+
+void ADFForest::Fill(const Mesh *mesh, const AveragedNormal *avgNormal, const FaceOctree *fOctree)
+{
+	for (std::vector<ADFOctree *>::iterator it=roots.begin(); it!=roots.end(); ++it)
+		(*it)->Fill(mesh, avgNormal, fOctree);
+}
+
+void ADFForest::FillAndPolygonize(const Mesh *mesh, const AveragedNormal *avgNormal, const FaceOctree *fOctree, Mesh *&result, bool bKeepOctree)
+{
+	// the triangles of all the roots go to the same list, as in MarchingCube::GetMeshFromForest
+	MarchingCube MC;
+	Poly plist;
+	Poly *plist_ptr = &plist;
+	for (std::vector<ADFOctree *>::iterator it=roots.begin(); it!=roots.end(); ++it)
+		(*it)->FillAndPolygonize(mesh, avgNormal, fOctree, MC, plist_ptr, bKeepOctree);
+	MC.AddReflectedPolys(this, plist, plist_ptr);
+	MC.GetMeshFromPolys(plist, plist_ptr, result);
+}
+
+void ADFForest::Update(const std::vector<Box3> &movedBoxes)
+{
+	for (std::vector<ADFOctree *>::iterator it=roots.begin(); it!=roots.end(); ++it)
+		(*it)->Update(movedBoxes);
+}
+
+int ADFForest::GetRootIndex(const Point3 &p) const
+{
+	Point3 coord((p-origin)/rootSize);
+	int x = max(0, min(nbRoots[0]-1, (int)floor(coord.x)));
+	int y = max(0, min(nbRoots[1]-1, (int)floor(coord.y)));
+	int z = max(0, min(nbRoots[2]-1, (int)floor(coord.z)));
+	return x + nbRoots[0]*(y + nbRoots[1]*z);
+}
+
+Box3 ADFForest::GetBBox() const
+{
+	Point3 forestWidth((float)nbRoots[0]*rootSize, (float)nbRoots[1]*rootSize, (float)nbRoots[2]*rootSize);
+	return Box3(origin, origin+forestWidth);
+}
+
+void ADFForest::GetDistances(const Point3 *points, int nbPoints, float *distances, Point3 *gradients) const
+{
+	if (symmetryAxis>=0){
+		// the points below the plane of symmetry are answered by their reflection
+		std::vector<Point3> reflected(points, points+nbPoints);
+		std::vector<bool> bReflected(nbPoints, false);
+		for (int i=0;i<nbPoints;++i){
+			if (reflected[i][symmetryAxis]<symmetryPlane){
+				reflected[i] = Reflect(reflected[i]);
+				bReflected[i] = true;
+			}
+		}
+		GetHalfDistances(&reflected[0], nbPoints, distances, gradients);
+		if (gradients){
+			for (int i=0;i<nbPoints;++i)
+				if (bReflected[i]) gradients[i][symmetryAxis] = -gradients[i][symmetryAxis];
+		}
+	}
+	else
+		GetHalfDistances(points, nbPoints, distances, gradients);
+}
+
+void ADFForest::GetHalfDistances(const Point3 *points, int nbPoints, float *distances, Point3 *gradients) const
+{
+	if (!nbPoints)
+		return;
+	if (roots.size()==1){
+		roots[0]->GetDistances(points, nbPoints, distances, gradients);
+		return;
+	}
+
+	// send each point to its root, and query the roots one after the other
+	std::vector<std::vector<int> > rootPoints(roots.size());
+	for (int i=0;i<nbPoints;++i)
+		rootPoints[GetRootIndex(points[i])].push_back(i);
+	std::vector<Point3> queries;
+	std::vector<float> rootDistances;
+	std::vector<Point3> rootGradients;
+	for (size_t r=0;r<roots.size();++r){
+		const std::vector<int> &indices = rootPoints[r];
+		int nbQueries = (int)indices.size();
+		if (!nbQueries)
+			continue;
+		queries.resize(nbQueries);
+		rootDistances.resize(nbQueries);
+		if (gradients) rootGradients.resize(nbQueries);
+		for (int i=0;i<nbQueries;++i)
+			queries[i] = points[indices[i]];
+		roots[r]->GetDistances(&queries[0], nbQueries, &rootDistances[0], gradients ? &rootGradients[0] : NULL);
+		for (int i=0;i<nbQueries;++i){
+			distances[indices[i]] = rootDistances[i];
+			if (gradients) gradients[indices[i]] = rootGradients[i];
+		}
+	}
+}
+
+void ADFForest::GetHermiteData(const Point3 *points, int nbPoints, Point3 *closest, Point3 *normals) const
+{
+	// the FaceOctree covers the whole mesh: any root can answer the points below the plane of symmetry
+	std::vector<int> missing;
+	for (int i=0;i<nbPoints;++i){
+		if (!roots[GetRootIndex(points[i])]->GetHermiteData(points[i], closest[i], normals[i]))
+			missing.push_back(i);
+	}
+	if (missing.empty())
+		return;
+	int nbMissing = (int)missing.size();
+	std::vector<Point3> queries(nbMissing);
+	std::vector<float> distances(nbMissing);
+	std::vector<Point3> gradients(nbMissing);
+	for (int i=0;i<nbMissing;++i)
+		queries[i] = points[missing[i]];
+	GetDistances(&queries[0], nbMissing, &distances[0], &gradients[0]);
+	for (int i=0;i<nbMissing;++i){
+		Point3 normal = gradients[i].Normalize();
+		closest[missing[i]] = queries[i] - normal*distances[i];
+		normals[missing[i]] = normal;
+	}
+}
+
+void ADFForest::GetDistanceBounds(const Box3 &box, float &minDist, float &maxDist) const
+{
+	// GetDistances answers the points below the plane of symmetry by their reflection, and the points outside
+	// of the forest by the closest point of the forest: clamping the box to the forest covers both
+	Box3 query(box);
+	if (symmetryAxis>=0){
+		query += Reflect(box.Min());
+		query += Reflect(box.Max());
+	}
+	Box3 forestBox = GetBBox();
+	Point3 fmin = forestBox.Min(), fmax = forestBox.Max();
+	Point3 qmin = query.Min(), qmax = query.Max();
+	for (int i=0;i<3;++i){
+		qmin[i] = max(fmin[i], min(fmax[i], qmin[i]));
+		qmax[i] = max(fmin[i], min(fmax[i], qmax[i]));
+	}
+	query = Box3(qmin, qmax);
+	minDist = 1e30f;
+	maxDist = -1e30f;
+	for (std::vector<ADFOctree *>::const_iterator it=roots.begin(); it!=roots.end(); ++it)
+		(*it)->GetDistanceBounds(query, minDist, maxDist);
+}
+
+int ADFForest::GetNumCells() const
+{
+	int nbCells = 0;
+	for (std::vector<ADFOctree *>::const_iterator it=roots.begin(); it!=roots.end(); ++it)
+		nbCells += (*it)->GetNumCells();
+	return nbCells;
+}
+
+size_t ADFForest::GetMemoryUsage() const
+{
+	size_t memory = 0;
+	for (std::vector<ADFOctree *>::const_iterator it=roots.begin(); it!=roots.end(); ++it)
+		memory += (*it)->GetMemoryUsage();
+	return memory;
+}
+
+#ifdef DISPLAY_MORPH_ENGINE
+void ADFForest::Display(GraphicsWindow *gw) const
+{
+	for (std::vector<ADFOctree *>::const_iterator it=roots.begin(); it!=roots.end(); ++it)
+		(*it)->Display(gw);
+}
+#endif // DISPLAY_MORPH_ENGINE
+
+extern std::ostream &operator<<(std::ostream &o, const ADFOctree &octree)
 {
+	o<<"Number of cells: "<<octree.GetNumCells()<<std::endl;
+	STATS(o<<"Peak number of cached distances: "<<octree.GetPeakCachedDistances()<<std::endl;)
+#ifdef OPTIMIZATIONS_SHARED_CORNERS
+	STATS(o<<"Number of lattice blocks: "<<octree.GetNumCornerBlocks()<<std::endl;)
+#endif // OPTIMIZATIONS_SHARED_CORNERS
+#ifdef OPTIMIZATIONS_BRICKS
+	STATS(o<<"Number of bricks: "<<octree.GetNumBricks()<<std::endl;)
+#endif // OPTIMIZATIONS_BRICKS
 	return o;
 }
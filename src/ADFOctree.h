@@ -17,9 +17,16 @@
 
 #include <vector>
 #include <map>
+#include <queue>
+#ifdef OPTIMIZATIONS_SSE
+	#include <emmintrin.h>
+#endif // OPTIMIZATIONS_SSE
 #include "Octree.h"
 #include "FaceOctree.h"
 
+class MarchingCube;
+typedef struct poly Poly;
+
 struct AveragedNormal{
 	struct PairOfPoints{
 		int p1, p2;
@@ -38,72 +45,572 @@ struct AveragedNormal{
 	Point3 *verticeNormal; // [numVertices]
 };
 
-class MyPoint3 : public Point3{
-public:
-	bool operator<(const MyPoint3 &p) const{
-		if (p.x<x) return true;
-		else if (p.x>x) return false;
-		if (p.y<y) return true;
-		else if (p.y>y) return false;
-		if (p.z<z) return true;
+// Simplified version of a mesh, with its normals and FaceOctree (same box as the one of the mesh)
+// every point of the mesh is within 'error' of the proxy and conversely, so the distances differ by 'error' at most
+struct ADFProxy{
+	const Mesh *mesh;
+	const AveragedNormal *avgNormal;
+	const FaceOctree *fOctree;
+	float error;
+	ADFProxy():mesh(NULL),avgNormal(NULL),fOctree(NULL),error(0.f){}
+	ADFProxy(const Mesh *mesh, const AveragedNormal *avgNormal, const FaceOctree *fOctree, float error):
+		mesh(mesh),avgNormal(avgNormal),fOctree(fOctree),error(error){}
+};
+
+// Integer position of a sample on the finest lattice of the octree (2^max_depth cells per axis)
+struct LatticePoint{
+	int x, y, z;
+	inline LatticePoint():x(0),y(0),z(0){}
+	inline LatticePoint(int x, int y, int z):x(x),y(y),z(z){}
+	bool operator<(const LatticePoint &p) const{
+		if (x<p.x) return true;
+		else if (x>p.x) return false;
+		if (y<p.y) return true;
+		else if (y>p.y) return false;
+		if (z<p.z) return true;
 		else return false;
 	}
-	explicit MyPoint3(const Point3 &c):Point3(c){}
 };
 
 extern std::ostream &operator<<(std::ostream &o, const FaceOctree&);
 
+// Range of the quantized distances for the compact encodings of the ADFCellValueT
+template <class T> struct ADFQuantization{};
+template <> struct ADFQuantization<short>{enum {RANGE = 32767};};
+template <> struct ADFQuantization<signed char>{enum {RANGE = 127};};
+
+// Min and max of the distance field over a cell, stored like its distances (normalised by the diagonal of the
+// cell): the quantized bounds are rounded outwards, and a bound clamped at the end of the band reads as
+// infinite, so that they still bound the field
+template <class T> struct ADFBoundsT
+{
+	T lo, hi;
+	ADFBoundsT():lo(0),hi(0){}
+	void Set(float lo_, float hi_, float diagonal){
+		float range = (float)ADFQuantization<T>::RANGE;
+		float scale = range/(ADF_QUANTIZATION_BAND*diagonal);
+		lo = (T)max(-range, min(range, (float)floor(lo_*scale)));
+		hi = (T)max(-range, min(range, (float)ceil(hi_*scale)));
+	}
+	void Get(float &lo_, float &hi_, float diagonal) const{
+		float scale = ADF_QUANTIZATION_BAND*diagonal/(float)ADFQuantization<T>::RANGE;
+		lo_ = (lo<=-ADFQuantization<T>::RANGE) ? -1e30f : scale*(float)lo;
+		hi_ = (hi>=ADFQuantization<T>::RANGE) ? 1e30f : scale*(float)hi;
+	}
+	// the sign of the bounds is kept by the rounding
+	inline bool MayContainSurface() const{return lo<0 && hi>=0;}
+};
+
+template <> inline void ADFBoundsT<float>::Set(float lo_, float hi_, float){lo = lo_; hi = hi_;}
+template <> inline void ADFBoundsT<float>::Get(float &lo_, float &hi_, float) const{lo_ = lo; hi_ = hi;}
+
+#ifdef OPTIMIZATIONS_SHARED_CORNERS
+// Table of the distances at the lattice vertices, a vertex is stored on the lattice of the coarsest level
+// holding it. The vertices of the ADF_LATTICE_DENSE_LEVELS finest levels are grouped in dense blocks of
+// 8x8x8 values of their level, allocated when the first vertex of the block is set. The vertices of the
+// coarser levels are too scattered for the blocks, they are stored one by one.
+class LatticeTable
+{
+// Data
+private:
+	enum {BLOCK_BITS = 3, BLOCK_SIZE = 1<<BLOCK_BITS, BLOCK_MASK = BLOCK_SIZE-1};
+	int max_depth;
+	// indexed by the level of the vertices
+	std::vector<std::map<LatticePoint, float *> > blocks;
+	std::vector<std::map<LatticePoint, float> > vertices;
+	int nbBlocks;
+	int nbVertices;
+
+// ctor - dtor
+public:
+	LatticeTable():max_depth(0),nbBlocks(0),nbVertices(0){}
+	~LatticeTable(){Clear();}
+
+// Member Functions
+private:
+	static inline LatticePoint GetBlock(const LatticePoint &lp){
+		return LatticePoint(lp.x>>BLOCK_BITS, lp.y>>BLOCK_BITS, lp.z>>BLOCK_BITS);
+	}
+	static inline int GetIndexInBlock(const LatticePoint &lp){
+		return (lp.x&BLOCK_MASK) + ((lp.y&BLOCK_MASK)<<BLOCK_BITS) + ((lp.z&BLOCK_MASK)<<(2*BLOCK_BITS));
+	}
+	// Get the coarsest level holding a vertex of the finest lattice, and the position of the vertex on its lattice
+	inline int GetLevel(const LatticePoint &lp, LatticePoint &levelPoint) const{
+		int bits = lp.x|lp.y|lp.z;
+		int shift = 0;
+		while (shift<max_depth && !(bits&(1<<shift))) ++shift;
+		levelPoint = LatticePoint(lp.x>>shift, lp.y>>shift, lp.z>>shift);
+		return max_depth-shift;
+	}
+	inline bool IsDense(int level) const{return level>max_depth-ADF_LATTICE_DENSE_LEVELS;}
+public:
+	void Init(int max_depth_){
+		Clear();
+		max_depth = max_depth_;
+		blocks.resize(max_depth+1);
+		vertices.resize(max_depth+1);
+	}
+	void Clear(){
+		for (size_t i=0;i<blocks.size();++i){
+			for (std::map<LatticePoint, float *>::iterator it=blocks[i].begin(); it!=blocks[i].end(); ++it)
+				delete [] it->second;
+			blocks[i].clear();
+			vertices[i].clear();
+		}
+		nbBlocks = nbVertices = 0;
+	}
+	inline void Set(const LatticePoint &lp, float distance){
+		LatticePoint p;
+		int level = GetLevel(lp, p);
+		if (!IsDense(level)){
+			std::map<LatticePoint, float>::iterator it = vertices[level].find(p);
+			if (it!=vertices[level].end())
+				it->second = distance;
+			else{
+				vertices[level][p] = distance;
+				++nbVertices;
+			}
+			return;
+		}
+		float *&block = blocks[level][GetBlock(p)];
+		if (!block){
+			block = new float[BLOCK_SIZE*BLOCK_SIZE*BLOCK_SIZE];
+			for (int i=0;i<BLOCK_SIZE*BLOCK_SIZE*BLOCK_SIZE;++i) block[i] = 0.f;
+			++nbBlocks;
+		}
+		block[GetIndexInBlock(p)] = distance;
+	}
+	inline float Get(const LatticePoint &lp) const{
+		LatticePoint p;
+		int level = GetLevel(lp, p);
+		if (!IsDense(level)){
+			std::map<LatticePoint, float>::const_iterator it = vertices[level].find(p);
+			ASSERT(it!=vertices[level].end());
+			return (it!=vertices[level].end()) ? it->second : 0.f;
+		}
+		std::map<LatticePoint, float *>::const_iterator it = blocks[level].find(GetBlock(p));
+		ASSERT(it!=blocks[level].end());
+		return (it!=blocks[level].end()) ? it->second[GetIndexInBlock(p)] : 0.f;
+	}
+	inline int GetNumBlocks() const{return nbBlocks;}
+	// a sparse vertex costs a node of a map (3 pointers and a color besides the value)
+	inline size_t GetMemoryUsage() const{
+		return nbBlocks*BLOCK_SIZE*BLOCK_SIZE*BLOCK_SIZE*sizeof(float) +
+			nbVertices*(sizeof(LatticePoint)+sizeof(float)+4*sizeof(void *));
+	}
+};
+
+// the distances are stored in the LatticeTable of the octree, cells only hold the bounds of their subtree
+// (on 16 bits, they only need to be conservative)
 struct ADFCellValue
+{
+	// min and max of the distance field over the cell, set by ADFOctree::ComputeBounds
+	ADFBoundsT<short> bounds;
+};
+#else // !OPTIMIZATIONS_SHARED_CORNERS
+template <class T> struct ADFCellValueT
 {
 // Data
-	float distances[8];
+	// the 8 corners, followed in OPTIMIZATIONS_TRIQUADRATIC by the 19 centers of the edges, faces and box of the cell
+	T distances[ADF_CELL_NODES];
+	// min and max of the distance field over the cell (its subtree for a node), set by ADFOctree::ComputeBounds
+	ADFBoundsT<T> bounds;
 //	int nFace;
 //	Point3 UVCoord;
 
 // Member Functions
-	ADFCellValue(){for (int i=0;i<8;++i) distances[i] = 0.f;}
-	explicit ADFCellValue(const ADFCellValue &otherValue){for (int i=0;i<8;++i) distances[i] = otherValue.distances[i];}
-	explicit ADFCellValue(float *distances_){for (int i=0;i<8;++i) distances[i] = distances_[i];}
+	ADFCellValueT(){for (int i=0;i<ADF_CELL_NODES;++i) distances[i] = 0;}
+	ADFCellValueT(const float *distances_, float diagonal){Encode(distances_, diagonal);}
+
+	// the distances are normalised by the diagonal of the cell, and clamped outside of the band
+	// a negative distance never rounds to 0 so that the sign of each corner is kept
+	void Encode(const float *distances_, float diagonal){
+		float scale = (float)ADFQuantization<T>::RANGE/(ADF_QUANTIZATION_BAND*diagonal);
+		for (int i=0;i<ADF_CELL_NODES;++i){
+			float q = distances_[i]*scale;
+			if (q>(float)ADFQuantization<T>::RANGE) q = (float)ADFQuantization<T>::RANGE;
+			if (q<-(float)ADFQuantization<T>::RANGE) q = -(float)ADFQuantization<T>::RANGE;
+			distances[i] = (T)((q<0.f) ? q-0.5f : q+0.5f);
+			if (distances[i]==0 && distances_[i]<0.f) distances[i] = -1;
+		}
+	}
+	void Decode(float *distances_, float diagonal) const{
+		float scale = ADF_QUANTIZATION_BAND*diagonal/(float)ADFQuantization<T>::RANGE;
+		for (int i=0;i<ADF_CELL_NODES;++i)
+			distances_[i] = scale*(float)distances[i];
+	}
+};
+
+template <> inline void ADFCellValueT<float>::Encode(const float *distances_, float)
+{
+	for (int i=0;i<ADF_CELL_NODES;++i) distances[i] = distances_[i];
+}
+template <> inline void ADFCellValueT<float>::Decode(float *distances_, float) const
+{
+	for (int i=0;i<ADF_CELL_NODES;++i) distances_[i] = distances[i];
+}
+
+// the SSE decoding only handles cells of 8 distances
+#if defined(OPTIMIZATIONS_SSE) && !defined(OPTIMIZATIONS_TRIQUADRATIC)
+template <> inline void ADFCellValueT<short>::Decode(float *distances_, float diagonal) const
+{
+	__m128 scale = _mm_set1_ps(ADF_QUANTIZATION_BAND*diagonal/(float)ADFQuantization<short>::RANGE);
+	__m128i q = _mm_loadu_si128((const __m128i *)distances);
+	// sign extend the 16 bits values to 32 bits
+	__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(q, q), 16);
+	__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(q, q), 16);
+	_mm_storeu_ps(distances_, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+	_mm_storeu_ps(distances_+4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+}
+template <> inline void ADFCellValueT<signed char>::Decode(float *distances_, float diagonal) const
+{
+	__m128 scale = _mm_set1_ps(ADF_QUANTIZATION_BAND*diagonal/(float)ADFQuantization<signed char>::RANGE);
+	__m128i q = _mm_loadl_epi64((const __m128i *)distances);
+	// sign extend the 8 bits values to 16 then 32 bits
+	q = _mm_srai_epi16(_mm_unpacklo_epi8(q, q), 8);
+	__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(q, q), 16);
+	__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(q, q), 16);
+	_mm_storeu_ps(distances_, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+	_mm_storeu_ps(distances_+4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+}
+#endif // OPTIMIZATIONS_SSE && !OPTIMIZATIONS_TRIQUADRATIC
+
+typedef ADFCellValueT<ADF_DISTANCE_TYPE> ADFCellValue;
+#endif // !OPTIMIZATIONS_SHARED_CORNERS
+
+#ifdef OPTIMIZATIONS_BRICKS
+// Pooled allocator of the dense bricks of distances used for the last ADF_BRICK_LEVELS levels of the ADFOctree
+// a brick covers BRICK_CELLS^3 cells of the finest level, and stores the distances at their BRICK_VERTICES^3 corners
+class BrickPool
+{
+// Data
+public:
+	enum {
+		BRICK_CELLS = 1<<ADF_BRICK_LEVELS,
+		BRICK_VERTICES = BRICK_CELLS+1,
+		BRICK_SIZE = BRICK_VERTICES*BRICK_VERTICES*BRICK_VERTICES,
+		CHUNK_SIZE = 64 // number of bricks allocated at once
+	};
+private:
+	std::vector<float *> chunks;
+	std::vector<float *> freeBricks;
+
+// ctor - dtor
+public:
+	BrickPool(){}
+	~BrickPool(){Clear();}
+
+// Member Functions
+public:
+	float *Allocate(){
+		if (freeBricks.empty()){
+			float *chunk = new float[CHUNK_SIZE*BRICK_SIZE];
+			chunks.push_back(chunk);
+			for (int i=CHUNK_SIZE-1;i>=0;--i)
+				freeBricks.push_back(chunk+i*BRICK_SIZE);
+		}
+		float *brick = freeBricks.back();
+		freeBricks.pop_back();
+		return brick;
+	}
+	void Release(float *brick){freeBricks.push_back(brick);}
+	size_t GetMemoryUsage() const{return chunks.size()*CHUNK_SIZE*BRICK_SIZE*sizeof(float);}
+	void Clear(){
+		for (std::vector<float *>::iterator it=chunks.begin(); it!=chunks.end(); ++it)
+			delete [] (*it);
+		chunks.clear();
+		freeBricks.clear();
+	}
+	static inline int GetIndex(int x, int y, int z){return x + BRICK_VERTICES*(y + BRICK_VERTICES*z);}
+	// Get the distances at the 8 corners of the (x,y,z) cell of a brick, in the same order as the ADFCellValue
+	static inline void GetCellDistances(const float *brick, int x, int y, int z, float distances[8]){
+		const float *d = brick + GetIndex(x, y, z);
+		distances[0] = d[0];											distances[1] = d[1];
+		distances[2] = d[BRICK_VERTICES];								distances[3] = d[BRICK_VERTICES+1];
+		distances[4] = d[BRICK_VERTICES*BRICK_VERTICES];				distances[5] = d[BRICK_VERTICES*BRICK_VERTICES+1];
+		distances[6] = d[BRICK_VERTICES*BRICK_VERTICES+BRICK_VERTICES];	distances[7] = d[BRICK_VERTICES*BRICK_VERTICES+BRICK_VERTICES+1];
+	}
+};
+#endif // OPTIMIZATIONS_BRICKS
+
+// Budget of the refinement of the ADFOctree, a null limit means no limit
+// when a limit is set the octree is refined best-first (the cell with the largest error is split first) until
+// the budget is spent, otherwise it is refined depth-first until the refinement criterion is met everywhere
+struct ADFBudget{
+	int max_cells;
+	int max_memory;	// in MB
+	float max_time;	// in seconds
+	ADFBudget():max_cells(0),max_memory(0),max_time(0.f){}
+	ADFBudget(int max_cells, int max_memory, float max_time):max_cells(max_cells),max_memory(max_memory),max_time(max_time){}
+	bool IsLimited() const{return max_cells>0 || max_memory>0 || max_time>0.f;}
+};
+
+// Refinement criterion of the ADFOctree: a cell is subdivided while the interpolation of its corners misses
+// one of its 19 sampled distances by more than
+//		max(relative_error * cell diagonal, min_error * object diagonal) / (1 + curvature_weight * bending)
+// bending goes from 0 (flat surface) to 2, it compares the pseudo-normal of the surface closest to the center
+// of the cell with the gradient interpolated from its corners
+struct ADFRefinement{
+	float relative_error;
+	float min_error;
+	float curvature_weight;
+	// part of the flat tolerance of a cell that the samples may lose by using a proxy of the mesh (0 for the full mesh only)
+	float proxy_ratio;
+	ADFBudget budget;
+	ADFRefinement():relative_error(0.f),min_error(0.f),curvature_weight(0.f),proxy_ratio(0.f){}
+	ADFRefinement(float relative_error, float min_error, float curvature_weight):
+		relative_error(relative_error),min_error(min_error),curvature_weight(curvature_weight),proxy_ratio(0.f){}
 };
 
 class ADFOctree: public Octree<ADFCellValue>
 {
 // Stats Data
 	USE_TIMER
+	STATS(int nbCachedDistances;)
+	STATS(int nbPeakCachedDistances;)
 
 // Data
 private:
-	float min_error;
+	ADFRefinement refinement;
 	const Mesh *mesh;
 	const FaceOctree *fOctree;
 	const AveragedNormal *avgNormal;
-	std::map<MyPoint3, float> mapDistances;
+	// cache of the sampled distances, split in blocks following the current traversal path:
+	// block 0 holds the samples lying on the root boundary, block l+1 the samples lying strictly
+	// inside the level-l cell being subdivided. A block is released as soon as its cell is done.
+	// the samples computed from a proxy keep their error, they are computed again if a finer cell needs them more accurate
+	// with OPTIMIZATIONS_SHARED_CORNERS a sample only goes in the lattice table once it is the corner of a cell
+	struct CachedSample{
+		float distance;
+		float error;
+		CachedSample():distance(0.f),error(0.f){}
+		CachedSample(float distance, float error):distance(distance),error(error){}
+	};
+	std::vector<std::map<LatticePoint, CachedSample> > mapDistances;
+	// simplified versions of the mesh, from the coarsest to the finest
+	std::vector<ADFProxy> proxies;
+#ifdef OPTIMIZATIONS_SHARED_CORNERS
+	// distances at the corners of the cells, stored once per lattice vertex
+	LatticeTable corners;
+#endif // OPTIMIZATIONS_SHARED_CORNERS
+#ifdef OPTIMIZATIONS_BRICKS
+	// the cells ADF_BRICK_LEVELS above their maximum depth (see GetBrickLevel) are not subdivided anymore, they
+	// are filled as dense bricks instead. Only the bricks crossing the surface are kept, indexed by the lattice
+	// position of their min corner
+	BrickPool brickPool;
+	std::map<LatticePoint, float *> bricks;
+#endif // OPTIMIZATIONS_BRICKS
 	std::vector<Coordinate>skippedCells;
 	float maxDist;
+	int nbCells;
+	// cells waiting to be split by the best-first refinement, sorted by their error relative to the tolerance
+	struct OpenCell{
+		Cell *cell;
+		Coordinate c;
+		Box3 box;
+		int level;
+		float distances[8];
+		float distComp[19];
+		OpenCell(Cell *cell, const Coordinate &c, const Box3 &box, int level):cell(cell),c(c),box(box),level(level){}
+	};
+	std::vector<OpenCell> openCells;
+	std::vector<int> freeOpenCells;
+	std::priority_queue<std::pair<float, int> > openQueue;
+	// cells split by RefineOpenCells during an Update (with their box), their bounds are set afterwards
+	std::vector<std::pair<Cell *, Box3> > *splitLog;
+	// polygonizer of the leaves as soon as they are final, during FillAndPolygonize only
+	MarchingCube *streamMC;
+	Poly **streamPolys;
+	bool bStreamDiscard;
 
 // ctor
 public:
-	ADFOctree(const Box3 &bbox, int max_depth, double min_error) : min_error(min_error), Octree(bbox, max_depth){
+	ADFOctree(const Box3 &bbox, int max_depth, const ADFRefinement &refinement) : refinement(refinement), Octree(bbox, max_depth){
 		mesh = NULL;
 		fOctree = NULL;
 		avgNormal = NULL;
+		splitLog = NULL;
+		streamMC = NULL;
+		streamPolys = NULL;
+		bStreamDiscard = false;
 		maxDist = (bbox.Max() - bbox.Min()).LengthSquared();
+		nbCells = 1;
+		mapDistances.resize(max_depth+1);
+#ifdef OPTIMIZATIONS_SHARED_CORNERS
+		corners.Init(max_depth);
+#endif // OPTIMIZATIONS_SHARED_CORNERS
+		STATS(nbCachedDistances = nbPeakCachedDistances = 0;)
 	}
 	~ADFOctree(){}
 
 // Member Functions
 private:
 	virtual void Reset(ADFCellValue value){value = ADFCellValue();}
-	float GetDistance(const Point3 &p, const std::vector<int> &vec) const;
+	float GetDistance(const Mesh *srcMesh, const AveragedNormal *srcNormal, const Point3 &p, const std::vector<int> &vec, Point3 *pseudoNormal=NULL, Point3 *closestPoint=NULL) const;
+	inline float GetDistance(const Point3 &p, const std::vector<int> &vec, Point3 *pseudoNormal=NULL, Point3 *closestPoint=NULL) const{
+		return GetDistance(mesh, avgNormal, p, vec, pseudoNormal, closestPoint);
+	}
+	float GetFlatTolerance(const Box3 &curBbox) const;
+	// 'centerNormal' is the pseudo-normal captured with the center sample, it's queried again if NULL
+	float GetTolerance(const float distances[8], float centerDist, const Point3 *centerNormal, const Box3 &curBbox) const;
+	LatticePoint GetLatticePoint(const Point3 &p) const;
+	int GetCacheBlock(const LatticePoint &lp) const;
+	// 'maxError' is the error allowed to the sample, so that it can be computed from a proxy of the mesh, the
+	// pseudo-normal of the closest surface is given in 'pseudoNormal' if it isn't NULL (null without faces)
+	float ComputeSampleDistance(const Point3 &p, float maxError=0.f, float *error=NULL, Point3 *pseudoNormal=NULL) const;
+	float GetSampleDistance(const Point3 &p, const LatticePoint &lp, float maxError=0.f, Point3 *pseudoNormal=NULL);
+#ifdef OPTIMIZATIONS_BRICKS
+	// the level of the bricks follows the maximum depth of the regions of interest
+	inline int GetBrickLevel(const Box3 &cellBox) const{return GetCellMaxDepth(cellBox)-ADF_BRICK_LEVELS;}
+	void FillBrick(const Box3 &curBbox, int level);
+#endif // OPTIMIZATIONS_BRICKS
+	float GetInterpolationError(float distances[8], float distComp[19]) const;
+	void FillBestFirst(float distances[8]);
+	void RefineOpenCells();
+	void EvaluateCell(Cell *cell, const Coordinate &c, const float distances[8], const Box3 &curBbox, int level);
+	void SplitCell(int index);
+#ifdef OPTIMIZATIONS_TRIQUADRATIC
+	// test the triquadratic interpolation of the 27 nodes of a cell at the centers of its 8 octants
+	bool CheckTriquadratic(const float nodes[27], const Box3 &curBbox, float tolerance, float maxError);
+#endif // OPTIMIZATIONS_TRIQUADRATIC
+	// refine again the leaves whose distances may have changed, and merge the childs not needed anymore
+	// returns true if the cell or one of its childs changed
+	bool UpdateCell(Cell *cell, Coordinate &c, const Box3 &curBbox, int level, const std::vector<Box3> &movedBoxes);
+	// set the bounds of the distances of the cells from the leaves up, once the octree is filled
+	void ComputeBounds(Cell *cell, const Box3 &curBbox);
+	// set the bounds of a node from the bounds of its childs
+	void MergeChildBounds(Cell *cell, const Box3 &curBbox);
+	// set the bounds of the ancestors of a cell whose subtree changed
+	void PropagateBounds(Cell *cell, Box3 curBbox);
+	// polygonize a cell whose subtree is final, and drop its childs if the octree isn't kept
+	void StreamCell(Cell *cell, const Box3 &curBbox);
+	void GetDistanceBounds(const Cell *cell, const Box3 &cellBox, const Box3 &box, float &minDist, float &maxDist) const;
 public:
+	STATS(int GetPeakCachedDistances() const{return nbPeakCachedDistances;})
+#ifdef OPTIMIZATIONS_SHARED_CORNERS
+	STATS(int GetNumCornerBlocks() const{return corners.GetNumBlocks();})
+#endif // OPTIMIZATIONS_SHARED_CORNERS
+	OPT_BRICKS(STATS(int GetNumBricks() const{return (int)bricks.size();}))
+	int GetNumCells() const{return nbCells;}
+	// Estimation of the memory used by the octree and the data of its refinement, in bytes
+	size_t GetMemoryUsage() const;
 	void Subdivide(Cell *cell, Coordinate &c, const Box3 &curBbox, int level);
+	// Remove the cells of the octree and the data of its fill (lattice table, bricks), Fill starts with it
+	void Clear();
 	void Fill(const Mesh *mesh_, const AveragedNormal *avgNormal_, const FaceOctree *fOctree_);
+	// Same as Fill, the leaves are added to the polys of 'MC' as soon as they are final instead of polygonizing the
+	// octree afterwards. If 'bKeepOctree' is false, the childs of a cell are dropped once they are polygonized
+	// and the octree ends up as its root alone. With a refinement budget, the leaves are only final once the
+	// budget is spent: the octree is polygonized after the fill, and kept.
+	void FillAndPolygonize(const Mesh *mesh_, const AveragedNormal *avgNormal_, const FaceOctree *fOctree_,
+						   MarchingCube &MC, Poly *&plist_ptr, bool bKeepOctree);
+	// Update a filled octree after some faces of its mesh moved, 'movedBoxes' are the bounding boxes of these faces
+	// before and after the move. The mesh, its normals and the FaceOctree given to Fill must already be up to date.
+	void Update(const std::vector<Box3> &movedBoxes);
 	void CreateMesh(Mesh &m) const;
-	bool GetAndCheckInterpDistances(float distances[8], float distComp[19]) const;
+	bool GetAndCheckInterpDistances(float distances[8], float distComp[19], float tolerance) const;
+	// the refinement criterion is only used by Fill, it can be changed between two fills
+	const ADFRefinement &GetRefinement() const{return refinement;}
+	void SetRefinement(const ADFRefinement &refinement_){refinement = refinement_;}
+	// the proxies are used by Fill, they must be sorted from the coarsest to the finest
+	void SetProxies(const std::vector<ADFProxy> &proxies_){proxies = proxies_;}
 	void Subdivide(Cell *cell, Coordinate &c, float *distances, const Box3 &curBbox, int level, bool bInit);
+
+	// Get the interpolated signed distances at an array of points, and their gradients if 'gradients' isn't NULL
+	// (points outside of the octree are clamped to its bounding box)
+	void GetDistances(const Point3 *points, int nbPoints, float *distances, Point3 *gradients=NULL) const;
+
+	// Get the distances at the 8 corners of a cell of the octree ('cellBox' is the bounding box of the cell)
+	void GetCellDistances(const Cell *cell, const Box3 &cellBox, float distances[8]) const;
+
+	// Get the closest point of the mesh to a point and the pseudo-normal of the closest feature (face, edge or vertex),
+	// the Hermite data of the surface near the point. Returns false if the mesh isn't available anymore.
+	bool GetHermiteData(const Point3 &p, Point3 &closest, Point3 &normal) const;
+
+	// Widen [minDist, maxDist] to bound the interpolated distances over the part of a box inside the octree,
+	// from the bounds of the cells crossing it. Returns false if the box doesn't touch the octree.
+	bool GetDistanceBounds(const Box3 &box, float &minDist, float &maxDist) const;
+	// A cell whose bounds have the same sign can't contain the surface, nor any of its childs
+	static inline bool MayContainSurface(const Cell *cell){
+		return cell->GetValue()->bounds.MayContainSurface();
+	}
+
+	#ifdef OPTIMIZATIONS_TRIQUADRATIC
+		// Get the 27 nodes of a cell of the octree, in the order of the ADFCellValue
+		void GetCellNodes(const Cell *cell, const Box3 &cellBox, float nodes[27]) const;
+		// Get the distances at the 8 corners of the i-th octant of a cell from its 27 nodes
+		static void GetOctantDistances(const float nodes[27], int i, float distances[8]);
+	#endif // OPTIMIZATIONS_TRIQUADRATIC
+
+	#ifdef OPTIMIZATIONS_BRICKS
+		// Get the brick of distances stored for a leaf of the octree, NULL if the leaf is a plain cell
+		const float *GetBrick(const Box3 &cellBox) const;
+	#endif // OPTIMIZATIONS_BRICKS
+
 	#ifdef DISPLAY_MORPH_ENGINE
 		virtual void Display(GraphicsWindow *gw) const;
 	#endif // DISPLAY_MORPH_ENGINE
 };
 
 extern std::ostream &operator<<(std::ostream &o, const ADFOctree&);
+
+// Forest of cubic ADFOctrees tiling the bounding box of a mesh, so that long and thin meshes don't spend the
+// resolution of a single cube along their short axes. Two neighbour roots compute the samples of their common
+// face from the same points with the same FaceOctree, so the field is continuous across the seams.
+class ADFForest
+{
+// Data
+private:
+	std::vector<ADFOctree *> roots;
+	Point3 origin;
+	float rootSize;
+	int nbRoots[3];
+	// axis (0, 1, 2 for x, y, z) of the normal of the plane of symmetry of the mesh, -1 if not symmetric
+	int symmetryAxis;
+	float symmetryPlane;
+
+// ctor - dtor
+public:
+	// 'bbox' is the box to tile, it is covered by at most 'max_roots' roots
+	// if the mesh is symmetric, only the half of the box above the plane of symmetry is tiled
+	ADFForest(const Box3 &bbox, int max_roots, int max_depth, const ADFRefinement &refinement, int symmetryAxis=-1, float symmetryPlane=0.f);
+	~ADFForest();
+
+// Member Functions
+private:
+	void GetHalfDistances(const Point3 *points, int nbPoints, float *distances, Point3 *gradients) const;
+public:
+	void SetRegionsOfInterest(const std::vector<RegionOfInterest> &regions, int base_depth);
+	void SetProxies(const std::vector<ADFProxy> &proxies);
+	void Fill(const Mesh *mesh, const AveragedNormal *avgNormal, const FaceOctree *fOctree);
+	// Same as ADFOctree::FillAndPolygonize for all the roots, 'result' is the mesh of the surface
+	void FillAndPolygonize(const Mesh *mesh, const AveragedNormal *avgNormal, const FaceOctree *fOctree, Mesh *&result, bool bKeepOctree);
+	// Same as ADFOctree::Update, for the roots reached by the moved faces
+	void Update(const std::vector<Box3> &movedBoxes);
+	inline int GetNumRoots() const{return (int)roots.size();}
+	// number of roots along an axis, the root (x,y,z) is the root x + nx*(y + ny*z)
+	inline int GetNumRoots(int axis) const{return nbRoots[axis];}
+	inline const ADFOctree *GetRoot(int i) const{return roots[i];}
+	Box3 GetBBox() const;
+	inline int GetSymmetryAxis() const{return symmetryAxis;}
+	inline Point3 Reflect(const Point3 &p) const{
+		Point3 r(p);
+		r[symmetryAxis] = 2.f*symmetryPlane-r[symmetryAxis];
+		return r;
+	}
+	// Get the index of the root containing a point (the points outside of the forest go to the closest root)
+	int GetRootIndex(const Point3 &p) const;
+	// Same as ADFOctree::GetDistances, each point is sent to the root containing it
+	void GetDistances(const Point3 *points, int nbPoints, float *distances, Point3 *gradients=NULL) const;
+	// Same as ADFOctree::GetHermiteData for an array of points. Where the mesh isn't available, the point is
+	// projected on the surface along the gradient of the interpolated distances.
+	void GetHermiteData(const Point3 *points, int nbPoints, Point3 *closest, Point3 *normals) const;
+	// Get the bounds of the distances given by GetDistances at any point of a box
+	void GetDistanceBounds(const Box3 &box, float &minDist, float &maxDist) const;
+	int GetNumCells() const;
+	size_t GetMemoryUsage() const;
+
+	#ifdef DISPLAY_MORPH_ENGINE
+		void Display(GraphicsWindow *gw) const;
+	#endif // DISPLAY_MORPH_ENGINE
+};
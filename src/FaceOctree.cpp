@@ -17,6 +17,7 @@
 #include "FaceOctree.h"
 #include "Distance.h"
 #include <fstream>
+#include <algorithm>
 #include "MemoryManager.h"
 
 bool FaceOctree::HasFaces(const Coordinate &c) const
@@ -33,6 +34,32 @@ bool FaceOctree::HasFaces(const Coordinate &c) const
 	return cell->value.faces.size()>0;
 }
 
+bool FaceOctree::HasFaces(const Box3 &box) const
+{
+	const Cell *cell = &root;
+	Box3 cellBox = bbox;
+	Box3 childBox;
+	Point3 boxMin = box.Min();
+	Point3 boxMax = box.Max();
+	Point3 center = box.Center();
+	while (cell->GetChildPointer(0)){
+		Point3 cellCenter = cellBox.Center();
+		int child = (center.x>cellCenter.x ? 1 : 0) + (center.y>cellCenter.y ? 2 : 0) + (center.z>cellCenter.z ? 4 : 0);
+		GetChildBox(cellBox, childBox, child);
+		Point3 childMin = childBox.Min();
+		Point3 childMax = childBox.Max();
+		if (boxMin.x<childMin.x || boxMin.y<childMin.y || boxMin.z<childMin.z ||
+			boxMax.x>childMax.x || boxMax.y>childMax.y || boxMax.z>childMax.z)
+			break; // the box overlaps several childs
+		cell = cell->GetChildPointer(child);
+		cellBox = childBox;
+	}
+#ifdef _FOCTREE_USE_BOOLEAN_SAMEASPARENT
+	while (cell->value.IsSameAsParent()) cell = cell->parent;
+#endif // _FOCTREE_USE_BOOLEAN_SAMEASPARENT
+	return cell->value.faces.size()>0;
+}
+
 namespace{
 	bool bAbort = false;
 }
@@ -45,7 +72,7 @@ void FaceOctree::Subdivide(Cell *cell, Box3 &curBbox, int level)
 		bAbort = true; 
 		return;
 	}
-	if (level<max_depth && cell->value.faces.size()>min_faces_for_subdivide){
+	if (level<GetCellMaxDepth(curBbox) && cell->value.faces.size()>min_faces_for_subdivide){
 		Point3 p1, p2, p3;
 		SUBDIVIDE(cell);
 		Box3 childBoxes[8];
@@ -80,7 +107,7 @@ void FaceOctree::Subdivide(Cell *cell, Box3 &curBbox, int level)
 #endif //_FOCTREE_USE_BOOLEAN_SAMEASPARENT
 }
 
-void FaceOctree::Fill(Mesh *mesh_)
+void FaceOctree::Fill(Mesh *mesh_, const std::vector<int> *faces)
 {
 	TIMER(TM_TOTAL);
 	
@@ -88,9 +115,13 @@ void FaceOctree::Fill(Mesh *mesh_)
 	
 	// Fill the list of faces for initialization of subdivide
 	std::vector<int> listOfFaces;
-	int numFaces = mesh->getNumFaces();
-	for (int i=0;i<numFaces; ++i)
-		listOfFaces.push_back(i);
+	if (faces)
+		listOfFaces = *faces;
+	else{
+		int numFaces = mesh->getNumFaces();
+		for (int i=0;i<numFaces; ++i)
+			listOfFaces.push_back(i);
+	}
 	root<<FaceCellValue(listOfFaces);
 
 	// Recursive call starting at the root node
@@ -102,6 +133,61 @@ void FaceOctree::Fill(Mesh *mesh_)
 	OUTPUT_STATS("FaceOctree");
 }
 
+#ifndef _FOCTREE_USE_BOOLEAN_SAMEASPARENT
+void FaceOctree::Refit(const std::vector<int> &movedFaces)
+{
+	TIMER(TM_TOTAL);
+
+	// the root keeps all its faces, only the cells below it depend on their position
+	if (!root.GetChildPointer(0)){
+		if (root.value.faces.size()>min_faces_for_subdivide)
+			Subdivide(&root, bbox, 0);
+		return;
+	}
+	Box3 childBox;
+	for (int i=0;i<8;++i){
+		GetChildBox(bbox, childBox, i);
+		RefitCell(root.GetChildPointer(i), childBox, 1, movedFaces);
+	}
+}
+
+void FaceOctree::RefitCell(Cell *cell, Box3 &curBbox, int level, const std::vector<int> &movedFaces)
+{
+	// remove the moved faces from the cell, then add back the ones still crossing it
+	std::vector<int> &faces = cell->value.faces;
+	size_t nbFaces = faces.size();
+	std::vector<int>::iterator last = faces.begin();
+	for (std::vector<int>::iterator it=faces.begin(); it!=faces.end(); ++it){
+		if (!std::binary_search(movedFaces.begin(), movedFaces.end(), *it))
+			*last++ = *it;
+	}
+	faces.erase(last, faces.end());
+	bool bChanged = (faces.size()!=nbFaces);
+	for (std::vector<int>::const_iterator it=movedFaces.begin(); it!=movedFaces.end(); ++it){
+		if (GetIntersection(curBbox,
+							mesh->verts[mesh->faces[*it].getVert(0)],
+							mesh->verts[mesh->faces[*it].getVert(1)],
+							mesh->verts[mesh->faces[*it].getVert(2)])){
+			faces.push_back(*it);
+			bChanged = true;
+		}
+	}
+	// the childs only hold faces of their parent, none of them had or has a moved face
+	if (!bChanged)
+		return;
+
+	if (cell->GetChildPointer(0)){
+		Box3 childBox;
+		for (int i=0;i<8;++i){
+			GetChildBox(curBbox, childBox, i);
+			RefitCell(cell->GetChildPointer(i), childBox, level+1, movedFaces);
+		}
+	}
+	else
+		Subdivide(cell, curBbox, level);
+}
+#endif // !_FOCTREE_USE_BOOLEAN_SAMEASPARENT
+
 bool FaceOctree::GetBoxCoordinate(Coordinate &c, const Point3 &p, int corner) const
 {
 	Point3 coord((p-bbox.Min())/bbox.Width());
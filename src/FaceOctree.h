@@ -92,8 +92,17 @@ private:
 		value.faces.clear();
 	}
 public:
-	void Fill(Mesh *mesh_);
+	// 'faces' restricts the octree to a subset of the faces of the mesh (all the faces if NULL)
+	void Fill(Mesh *mesh_, const std::vector<int> *faces=NULL);
 	void Subdivide(Cell *cell, Box3 &bbox, int level);
+#ifndef _FOCTREE_USE_BOOLEAN_SAMEASPARENT
+	// Move the faces of 'movedFaces' (sorted) to the cells crossed by their new position, once the vertices of the
+	// mesh given to Fill have been moved. The leaves getting too many faces are subdivided.
+	void Refit(const std::vector<int> &movedFaces);
+private:
+	void RefitCell(Cell *cell, Box3 &curBbox, int level, const std::vector<int> &movedFaces);
+public:
+#endif // !_FOCTREE_USE_BOOLEAN_SAMEASPARENT
 	
 	// Get the list of faces to process for the i-th corner of the octree
 	const std::vector<int> &GetListOfFacesFromCorner(int index) const;
@@ -112,6 +121,8 @@ public:
 	void GetDeepestCoordinate(Coordinate &c) const;
 
 	bool HasFaces(const Coordinate &c) const;
+	// same test for an arbitrary box: the faces of the smallest cell containing the box
+	bool HasFaces(const Box3 &box) const;
 
 	#ifdef DISPLAY_MORPH_ENGINE
 		virtual void Display(GraphicsWindow *gw) const;
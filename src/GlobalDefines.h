@@ -29,6 +29,40 @@
 	#define OPT_OCTREE(x)
 #endif
 
+// uncomment this line to store the distances of the ADFOctree once per lattice vertex instead of once per cell corner
+// the vertices of the ADF_LATTICE_DENSE_LEVELS finest levels are stored in dense blocks, the coarser ones sparsely
+//#define OPTIMIZATIONS_SHARED_CORNERS
+#define ADF_LATTICE_DENSE_LEVELS	2
+
+// type used to store the distances in the cells of the ADFOctree: float, or short/signed char for a compact storage
+// where the distances are normalised by the diagonal of the cell and clamped to +/- ADF_QUANTIZATION_BAND diagonals
+#define ADF_DISTANCE_TYPE		float
+#define ADF_QUANTIZATION_BAND	2.f
+
+// uncomment this line to store the last ADF_BRICK_LEVELS levels of the ADFOctree as dense bricks of distances
+//#define OPTIMIZATIONS_BRICKS
+#define ADF_BRICK_LEVELS		3
+#ifdef OPTIMIZATIONS_BRICKS
+	#define OPT_BRICKS(x) x
+#else
+	#define OPT_BRICKS(x)
+#endif
+
+// uncomment this line to store 27 distances per cell of the ADFOctree (corners, centers of the edges, faces and box)
+// interpolated triquadratically: the curved parts of the surface are approximated with less cells
+//#define OPTIMIZATIONS_TRIQUADRATIC
+#ifdef OPTIMIZATIONS_TRIQUADRATIC
+	#define ADF_CELL_NODES			27
+	#if defined(OPTIMIZATIONS_SHARED_CORNERS) || defined(OPTIMIZATIONS_BRICKS)
+		#error OPTIMIZATIONS_TRIQUADRATIC cannot be used with OPTIMIZATIONS_SHARED_CORNERS or OPTIMIZATIONS_BRICKS
+	#endif
+#else
+	#define ADF_CELL_NODES			8
+#endif
+
+// comment this line to use the plain C++ versions of the SSE code paths
+#define OPTIMIZATIONS_SSE
+
 #define OPTIMIZATIONS_INLINE
 #ifdef OPTIMIZATIONS_INLINE
 	#define INLINE inline
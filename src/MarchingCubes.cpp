@@ -23,6 +23,9 @@
 #include <algorithm>
 #include <list>
 #include <deque>
+#ifdef OPTIMIZATIONS_SSE
+#include <xmmintrin.h>
+#endif // OPTIMIZATIONS_SSE
 
 namespace{
 	template <class T> struct MyEdge
@@ -52,7 +55,7 @@ namespace{
 	typedef MyEdge<SplPoint2> MyEdge2D;
 
 	#define INTERP(C,a,b) (minBox.##C + abs(dist[a]/(dist[b]-dist[a]))*(maxBox.##C-minBox.##C))
-	inline void GetMidPoint(const Point3 &minBox, const Point3 &maxBox, SplPoint3 &p, float *dist, int i)
+	inline void GetMidPoint(const Point3 &minBox, const Point3 &maxBox, SplPoint3 &p, const float *dist, int i)
 	{
 		switch (i){
 			case 0:		p.x = INTERP(x,0,1);	p.y = minBox.y;			p.z = minBox.z;			break;
@@ -111,6 +114,45 @@ namespace{
 		// (det == 0) => The segments are colinear.
 		return true;
 	}
+
+	// Quadratic error function of a vertex of the dual contouring: the sum of its squared distances to the tangent
+	// planes of the Hermite data, plus a pull towards the mean of the Hermite points which keeps the system
+	// solvable on the flat parts (where the planes don't fix the vertex along the surface)
+	struct QEF{
+		double ata[6];		// xx, xy, xz, yy, yz, zz
+		double atb[3];
+		Point3 sum;
+		int nbPoints;
+
+		QEF():sum(0.f,0.f,0.f),nbPoints(0){
+			for (int i=0;i<6;++i) ata[i] = 0.;
+			for (int i=0;i<3;++i) atb[i] = 0.;
+		}
+		void Add(const Point3 &p, const Point3 &n){
+			double d = DotProd(n, p);
+			ata[0] += n.x*n.x;	ata[1] += n.x*n.y;	ata[2] += n.x*n.z;
+			ata[3] += n.y*n.y;	ata[4] += n.y*n.z;	ata[5] += n.z*n.z;
+			atb[0] += n.x*d;	atb[1] += n.y*d;	atb[2] += n.z*d;
+			sum += p;
+			++nbPoints;
+		}
+		Point3 Solve(float regularization) const{
+			Point3 mean = sum/(float)nbPoints;
+			// solve (AtA + r.I) x = Atb - AtA.mean around the mean, with the Cramer's rule
+			double l = regularization*nbPoints;
+			double a = ata[0]+l, b = ata[1], c = ata[2], d = ata[3]+l, e = ata[4], f = ata[5]+l;
+			double r0 = atb[0] - (ata[0]*mean.x + ata[1]*mean.y + ata[2]*mean.z);
+			double r1 = atb[1] - (ata[1]*mean.x + ata[3]*mean.y + ata[4]*mean.z);
+			double r2 = atb[2] - (ata[2]*mean.x + ata[4]*mean.y + ata[5]*mean.z);
+			double det = a*(d*f-e*e) - b*(b*f-e*c) + c*(b*e-d*c);
+			if (det<=0.)
+				return mean;
+			double x = (r0*(d*f-e*e) - b*(r1*f-e*r2) + c*(r1*e-d*r2))/det;
+			double y = (a*(r1*f-e*r2) - r0*(b*f-e*c) + c*(b*r2-r1*c))/det;
+			double z = (a*(d*r2-r1*e) - b*(b*r2-r1*c) + r0*(b*e-d*c))/det;
+			return mean + Point3((float)x, (float)y, (float)z);
+		}
+	};
 }
 
 //extern Mesh m_temp;
@@ -135,13 +177,16 @@ void RecCountNodes(int &cpt, Node *node)
 }
 */
 
-void MarchingCube::GetMeshFromOctree(ADFOctree::Cell *root, const Box3 &curBbox, Mesh *&mesh)
+void MarchingCube::GetMeshFromForest(const ADFForest *forest, Mesh *&mesh)
 {
 	Poly plist;
 	Poly *plist_ptr = &plist;
 
 	// <----- uncomment after test
-	ComputeMCInCell(root, curBbox, plist_ptr);
+	// the triangles of all the roots go to the same list, the vertices on the seams are merged with the others
+	for (int i=0;i<forest->GetNumRoots();++i)
+		ComputeMCInOctree(forest->GetRoot(i), plist_ptr);
+	AddReflectedPolys(forest, plist, plist_ptr);
 	// ------------>
 	
 	// <------- remove when done
@@ -159,6 +204,520 @@ void MarchingCube::GetMeshFromOctree(ADFOctree::Cell *root, const Box3 &curBbox,
 	//}
 	// ------------->
 
+	GetMeshFromPolys(plist, plist_ptr, mesh);
+}
+
+void MarchingCube::GetDualMeshFromForest(const ADFForest *forest, Mesh *&mesh)
+{
+	dualVertices.clear();
+	dualPoints.clear();
+	dualCells.clear();
+	bContouring = false;
+	WalkDualGrid(forest);
+
+	// the distances at all the dual vertices are queried at once
+	Poly plist;
+	Poly *plist_ptr = &plist;
+	std::vector<float> distances(dualPoints.size());
+	if (!dualPoints.empty())
+		forest->GetDistances(&dualPoints[0], (int)dualPoints.size(), &distances[0]);
+	for (size_t k=0;k+8<=dualCells.size();k+=8){
+		float dist[8];
+		Point3 corners[8];
+		for (int i=0;i<8;++i){
+			dist[i] = distances[dualCells[k+i]];
+			corners[i] = dualPoints[dualCells[k+i]];
+		}
+		ComputeMCInDualCell(dist, corners, plist_ptr);
+	}
+	dualVertices.clear();
+	dualPoints.clear();
+	dualCells.clear();
+	AddReflectedPolys(forest, plist, plist_ptr);
+	GetMeshFromPolys(plist, plist_ptr, mesh);
+}
+
+void MarchingCube::GetDualContourFromForest(const ADFForest *forest, Mesh *&mesh)
+{
+	dualVertices.clear();
+	dualPoints.clear();
+	contourCells.clear();
+	contourBoxes.clear();
+	contourEdges.clear();
+	bContouring = true;
+	WalkDualGrid(forest);
+	bContouring = false;
+
+	// the signs at the ends of the minimal edges are queried at once, then the Hermite data of the crossed edges
+	std::vector<float> distances(dualPoints.size());
+	if (!dualPoints.empty())
+		forest->GetDistances(&dualPoints[0], (int)dualPoints.size(), &distances[0]);
+	std::vector<int> crossedEdges;
+	std::vector<Point3> crossings;
+	for (size_t k=0;k<contourEdges.size();++k){
+		float d0 = distances[contourEdges[k].ends[0]];
+		float d1 = distances[contourEdges[k].ends[1]];
+		if ((d0<0.f)==(d1<0.f))
+			continue;
+		const Point3 &p0 = dualPoints[contourEdges[k].ends[0]];
+		const Point3 &p1 = dualPoints[contourEdges[k].ends[1]];
+		crossedEdges.push_back((int)k);
+		crossings.push_back(p0 + (p1-p0)*(d0/(d0-d1)));
+	}
+	int nbCrossed = (int)crossedEdges.size();
+	std::vector<Point3> hermitePoints(nbCrossed);
+	std::vector<Point3> hermiteNormals(nbCrossed);
+	if (nbCrossed)
+		forest->GetHermiteData(&crossings[0], nbCrossed, &hermitePoints[0], &hermiteNormals[0]);
+
+	// each crossed edge constrains the vertices of the (up to 4) leaves around it, the vertices are then solved
+	// independently from each other and kept in their leaf
+	std::vector<QEF> qefs(contourBoxes.size());
+	for (int k=0;k<nbCrossed;++k){
+		const ContourEdge &edge = contourEdges[crossedEdges[k]];
+		// the Hermite point may be far from the edge when the mesh isn't closed, keep the crossing then
+		Point3 p = hermitePoints[k];
+		if (!contourBoxes[edge.cells[0]].Contains(p) && !contourBoxes[edge.cells[1]].Contains(p)
+			&& !contourBoxes[edge.cells[2]].Contains(p) && !contourBoxes[edge.cells[3]].Contains(p))
+			p = crossings[k];
+		for (int q=0;q<4;++q){
+			bool bDone = false;
+			for (int r=0;r<q && !bDone;++r)
+				bDone = (edge.cells[r]==edge.cells[q]);
+			if (!bDone)
+				qefs[edge.cells[q]].Add(p, hermiteNormals[k]);
+		}
+	}
+	std::vector<Point3> cellVertices(contourBoxes.size());
+	for (size_t c=0;c<qefs.size();++c){
+		if (!qefs[c].nbPoints)
+			continue;
+		Point3 v = qefs[c].Solve(DC_QEF_REGULARIZATION);
+		const Box3 &box = contourBoxes[c];
+		for (int a=0;a<3;++a)
+			v[a] = max(box.Min()[a], min(box.Max()[a], v[a]));
+		cellVertices[c] = v;
+	}
+
+	// one quad per crossed edge, wound as the triangles of the marching cubes (their normal goes inside, see
+	// GetMeshFromPolys). The slots 0, 2, 3, 1 turn clockwise around the axis for x and z, counterclockwise for y.
+	Poly plist;
+	Poly *plist_ptr = &plist;
+	for (int k=0;k<nbCrossed;++k){
+		const ContourEdge &edge = contourEdges[crossedEdges[k]];
+		SplPoint3 quad[4];
+		static const int order[4] = {0, 2, 3, 1};
+		bool bInsideAtMin = distances[edge.ends[0]]<0.f;
+		bool bReverse = (bInsideAtMin == (edge.axis==1));
+		for (int i=0;i<4;++i){
+			int q = order[bReverse ? 3-i : i];
+			Point3 v = cellVertices[edge.cells[q]];
+			for (int a=0;a<3;++a){
+				if (edge.flat[q][a]>=0)
+					v[a] = edge.flat[q][a] ? dualBox.Max()[a] : dualBox.Min()[a];
+			}
+			quad[i] = SplPoint3(v.x, v.y, v.z);
+		}
+		// a leaf can take two slots around the edge, the quad is a triangle then
+		for (int t=0;t<2;++t){
+			const SplPoint3 &vertex1 = quad[0];
+			const SplPoint3 &vertex2 = quad[1+t];
+			const SplPoint3 &vertex3 = quad[2+t];
+			if (vertex1==vertex2 || vertex2==vertex3 || vertex3==vertex1)
+				continue;
+			plist_ptr->vertices[0][0] = vertex1.x;	plist_ptr->vertices[0][1] = vertex1.y;	plist_ptr->vertices[0][2] = vertex1.z;
+			plist_ptr->vertices[1][0] = vertex2.x;	plist_ptr->vertices[1][1] = vertex2.y;	plist_ptr->vertices[1][2] = vertex2.z;
+			plist_ptr->vertices[2][0] = vertex3.x;	plist_ptr->vertices[2][1] = vertex3.y;	plist_ptr->vertices[2][2] = vertex3.z;
+			plist_ptr->next = new Poly ();
+			plist_ptr = plist_ptr->next;
+		}
+	}
+	dualVertices.clear();
+	dualPoints.clear();
+	contourCells.clear();
+	contourBoxes.clear();
+	contourEdges.clear();
+	AddReflectedPolys(forest, plist, plist_ptr);
+	GetMeshFromPolys(plist, plist_ptr, mesh);
+}
+
+void MarchingCube::WalkDualGrid(const ADFForest *forest)
+{
+	dualBox = forest->GetBBox();
+	// all the roots have the same depth
+	maxLevel = forest->GetRoot(0)->max_depth - lod;
+
+	// the roots are walked as the childs of a virtual node, padded by one root on each side: the padding
+	// stands for the outside of the forest, so that the dual cells reach the faces of its box
+	int n[3] = {forest->GetNumRoots(0), forest->GetNumRoots(1), forest->GetNumRoots(2)};
+	#define PADDED_INDEX(x,y,z) ((x+1) + (n[0]+2)*((y+1) + (n[1]+2)*(z+1)))
+	std::vector<DualNode> padded((n[0]+2)*(n[1]+2)*(n[2]+2));
+	std::vector<bool> bReal(padded.size());
+	for (int z=-1;z<=n[2];++z){
+		for (int y=-1;y<=n[1];++y){
+			for (int x=-1;x<=n[0];++x){
+				int p[3] = {x, y, z};
+				int r[3];
+				DualNode &node = padded[PADDED_INDEX(x,y,z)];
+				bool bInside = true;
+				for (int a=0;a<3;++a){
+					r[a] = max(0, min(n[a]-1, p[a]));
+					node.flat[a] = (p[a]<0) ? 0 : ((p[a]>=n[a]) ? 1 : -1);
+					if (node.flat[a]>=0) bInside = false;
+				}
+				node.octree = forest->GetRoot(r[0] + n[0]*(r[1] + n[1]*r[2]));
+				node.cell = &node.octree->root;
+				node.box = node.octree->bbox;
+				node.level = 0;
+				node.virtualLevels = GetVirtualLevels(node);
+				bReal[PADDED_INDEX(x,y,z)] = bInside;
+			}
+		}
+	}
+	for (int z=-1;z<=n[2];++z){
+		for (int y=-1;y<=n[1];++y){
+			for (int x=-1;x<=n[0];++x){
+				if (bReal[PADDED_INDEX(x,y,z)])
+					DualNodeProc(padded[PADDED_INDEX(x,y,z)]);
+				// the groups of nodes with the current one at their min corner, skipped if they are all outside
+				for (int a=0;a<3;++a){
+					int e[3] = {0, 0, 0};
+					e[a] = 1;
+					if (x+e[0]>n[0] || y+e[1]>n[1] || z+e[2]>n[2])
+						continue;
+					if (bReal[PADDED_INDEX(x,y,z)] || bReal[PADDED_INDEX(x+e[0],y+e[1],z+e[2])])
+						DualFaceProc(padded[PADDED_INDEX(x,y,z)], padded[PADDED_INDEX(x+e[0],y+e[1],z+e[2])], a);
+				}
+				for (int a=0;a<3;++a){
+					// the 4 nodes around an edge along 'a', indexed by their position along the two other axes
+					int lo = (a==0) ? 1 : 0;
+					int hi = (a==2) ? 1 : 2;
+					DualNode nodes[4];
+					bool bAny = false, bValid = true;
+					for (int q=0;q<4;++q){
+						int p[3] = {x, y, z};
+						p[lo] += q&1;
+						p[hi] += (q>>1)&1;
+						if (p[lo]>n[lo] || p[hi]>n[hi]){
+							bValid = false;
+							break;
+						}
+						nodes[q] = padded[PADDED_INDEX(p[0],p[1],p[2])];
+						if (bReal[PADDED_INDEX(p[0],p[1],p[2])]) bAny = true;
+					}
+					if (bValid && bAny)
+						DualEdgeProc(nodes, a);
+				}
+				if (x<n[0] && y<n[1] && z<n[2]){
+					DualNode nodes[8];
+					bool bAny = false;
+					for (int v=0;v<8;++v){
+						int index = PADDED_INDEX(x+(v&1), y+((v>>1)&1), z+((v>>2)&1));
+						nodes[v] = padded[index];
+						if (bReal[index]) bAny = true;
+					}
+					if (bAny)
+						DualVertProc(nodes);
+				}
+			}
+		}
+	}
+	#undef PADDED_INDEX
+}
+
+bool MarchingCube::IsDualLeaf(const DualNode &node) const
+{
+	if (node.level>=maxLevel)
+		return true;
+	return node.virtualLevels==0 && node.cell->GetChildPointer(0)==NULL;
+}
+
+MarchingCube::DualNode MarchingCube::GetDualChild(const DualNode &node, int i) const
+{
+	if (IsDualLeaf(node))
+		return node;
+	// a node outside of the forest only has the childs of its cell next to the boundary
+	for (int a=0;a<3;++a){
+		if (node.flat[a]>=0)
+			i = (i & ~(1<<a)) | (node.flat[a]<<a);
+	}
+	DualNode child(node);
+	GetChildBox(node.box, child.box, i);
+	++child.level;
+	if (node.virtualLevels>0){
+		--child.virtualLevels;
+		return child;
+	}
+	child.cell = node.cell->GetChildPointer(i);
+	child.virtualLevels = GetVirtualLevels(child);
+	return child;
+}
+
+int MarchingCube::GetVirtualLevels(const DualNode &node)
+{
+	if (node.cell->GetChildPointer(0))
+		return 0;
+#ifdef OPTIMIZATIONS_BRICKS
+	if (node.octree->GetBrick(node.box))
+		return ADF_BRICK_LEVELS;
+#endif // OPTIMIZATIONS_BRICKS
+#ifdef OPTIMIZATIONS_TRIQUADRATIC
+	// the 27 nodes of a triquadratic leaf are the corners of its octants
+	return 1;
+#else
+	return 0;
+#endif // OPTIMIZATIONS_TRIQUADRATIC
+}
+
+void MarchingCube::DualNodeProc(const DualNode &node)
+{
+	if (IsDualLeaf(node))
+		return;
+	DualNode childs[8];
+	for (int i=0;i<8;++i){
+		childs[i] = GetDualChild(node, i);
+		DualNodeProc(childs[i]);
+	}
+	for (int a=0;a<3;++a){
+		int lo = (a==0) ? 1 : 0;
+		int hi = (a==2) ? 1 : 2;
+		for (int i=0;i<8;++i){
+			if (!(i&(1<<a)))
+				DualFaceProc(childs[i], childs[i|(1<<a)], a);
+		}
+		for (int s=0;s<2;++s){
+			DualNode nodes[4];
+			for (int q=0;q<4;++q)
+				nodes[q] = childs[(s<<a) | ((q&1)<<lo) | (((q>>1)&1)<<hi)];
+			DualEdgeProc(nodes, a);
+		}
+	}
+	DualVertProc(childs);
+}
+
+void MarchingCube::DualFaceProc(const DualNode &n0, const DualNode &n1, int axis)
+{
+	if (IsDualLeaf(n0) && IsDualLeaf(n1))
+		return;
+	int A = 1<<axis;
+	// the childs of n0 on the max side of the face, and the ones of n1 on its min side
+	for (int k=0;k<8;++k){
+		if (!(k&A))
+			DualFaceProc(GetDualChild(n0, k|A), GetDualChild(n1, k), axis);
+	}
+	// the edges lying in the face, along the two other axes
+	for (int b=0;b<3;++b){
+		if (b==axis)
+			continue;
+		int lo = (b==0) ? 1 : 0;
+		int hi = (b==2) ? 1 : 2;
+		for (int s=0;s<2;++s){
+			DualNode nodes[4];
+			for (int q=0;q<4;++q){
+				// position of the node of the slot q around the edge
+				int v = (s<<b) | ((q&1)<<lo) | (((q>>1)&1)<<hi);
+				// the edge crosses the middle of the face: only the side along the axis of the face is opposite
+				nodes[q] = GetDualChild((v&A) ? n1 : n0, v^A);
+			}
+			DualEdgeProc(nodes, b);
+		}
+	}
+	DualNode nodes[8];
+	for (int v=0;v<8;++v)
+		nodes[v] = GetDualChild((v&A) ? n1 : n0, v^A);
+	DualVertProc(nodes);
+}
+
+void MarchingCube::DualEdgeProc(const DualNode nodes[4], int axis)
+{
+	if (IsDualLeaf(nodes[0]) && IsDualLeaf(nodes[1]) && IsDualLeaf(nodes[2]) && IsDualLeaf(nodes[3])){
+		// the edge of the smallest of the leaves is a minimal edge of the octrees
+		if (bContouring)
+			AddContourEdge(nodes, axis);
+		return;
+	}
+	int lo = (axis==0) ? 1 : 0;
+	int hi = (axis==2) ? 1 : 2;
+	int LH = (1<<lo)|(1<<hi);
+	// the node of the slot q is on the side q of the edge, its childs next to the edge are on the other side
+	for (int s=0;s<2;++s){
+		DualNode childs[4];
+		for (int q=0;q<4;++q){
+			int v = (s<<axis) | ((q&1)<<lo) | (((q>>1)&1)<<hi);
+			childs[q] = GetDualChild(nodes[q], v^LH);
+		}
+		DualEdgeProc(childs, axis);
+	}
+	DualNode childs[8];
+	for (int v=0;v<8;++v){
+		int q = ((v>>lo)&1) | (((v>>hi)&1)<<1);
+		childs[v] = GetDualChild(nodes[q], v^LH);
+	}
+	DualVertProc(childs);
+}
+
+void MarchingCube::DualVertProc(const DualNode nodes[8])
+{
+	// the dual contouring only needs the edges
+	if (bContouring)
+		return;
+	bool bLeaves = true;
+	for (int v=0;v<8 && bLeaves;++v)
+		bLeaves = IsDualLeaf(nodes[v]);
+	if (!bLeaves){
+		// the node at the position v around the vertex touches it with its child 7-v
+		DualNode childs[8];
+		for (int v=0;v<8;++v)
+			childs[v] = GetDualChild(nodes[v], v^7);
+		DualVertProc(childs);
+		return;
+	}
+	for (int v=0;v<8;++v)
+		dualCells.push_back(GetDualVertex(nodes[v]));
+}
+
+int MarchingCube::GetDualVertex(const DualNode &node)
+{
+	Point3 p = node.box.Center();
+	for (int a=0;a<3;++a){
+		if (node.flat[a]>=0)
+			p[a] = node.flat[a] ? dualBox.Max()[a] : dualBox.Min()[a];
+	}
+	return GetDualPoint(p);
+}
+
+int MarchingCube::GetDualPoint(const Point3 &p)
+{
+	SplPoint3 key(p.x, p.y, p.z);
+	std::map<SplPoint3, int>::const_iterator it = dualVertices.find(key);
+	if (it!=dualVertices.end())
+		return it->second;
+	int index = (int)dualPoints.size();
+	dualVertices[key] = index;
+	dualPoints.push_back(p);
+	return index;
+}
+
+int MarchingCube::GetContourCell(const DualNode &node)
+{
+	// a node outside of the forest shares the cell of the leaf it stands for
+	Point3 center = node.box.Center();
+	SplPoint3 key(center.x, center.y, center.z);
+	std::map<SplPoint3, int>::const_iterator it = contourCells.find(key);
+	if (it!=contourCells.end())
+		return it->second;
+	int index = (int)contourBoxes.size();
+	contourCells[key] = index;
+	contourBoxes.push_back(node.box);
+	return index;
+}
+
+void MarchingCube::AddContourEdge(const DualNode nodes[4], int axis)
+{
+	int lo = (axis==0) ? 1 : 0;
+	int hi = (axis==2) ? 1 : 2;
+	// the nodes around the edge aren't flattened along it: its ends are the ones of the smallest node, it is
+	// on the max side along lo (hi) of the nodes of the slots 0 and 2 (0 and 1), on the min side of the others
+	int smallest = 0;
+	for (int q=1;q<4;++q){
+		if (nodes[q].box.Width()[axis]<nodes[smallest].box.Width()[axis])
+			smallest = q;
+	}
+	Point3 p0 = nodes[smallest].box.Min();
+	Point3 p1 = nodes[smallest].box.Max();
+	for (int q=0;q<4;++q){
+		if (nodes[q].flat[lo]<0)
+			p0[lo] = p1[lo] = (q&1) ? nodes[q].box.Min()[lo] : nodes[q].box.Max()[lo];
+		if (nodes[q].flat[hi]<0)
+			p0[hi] = p1[hi] = (q&2) ? nodes[q].box.Min()[hi] : nodes[q].box.Max()[hi];
+	}
+	ContourEdge edge;
+	for (int q=0;q<4;++q){
+		edge.cells[q] = GetContourCell(nodes[q]);
+		for (int a=0;a<3;++a)
+			edge.flat[q][a] = nodes[q].flat[a];
+	}
+	edge.axis = axis;
+	edge.ends[0] = GetDualPoint(p0);
+	edge.ends[1] = GetDualPoint(p1);
+	contourEdges.push_back(edge);
+}
+
+void MarchingCube::ComputeMCInDualCell(const float dist[8], const Point3 corners[8], Poly *&plist_ptr) const
+{
+	int indexInMap = GetIndexInMap(dist);
+	if (indexInMap==0 || indexInMap==255)
+		return;
+	SplPoint3 midVertices[12];
+	for (int i=0;i<12;++i){
+		int a, b;
+		GetEdgeCorners(i, a, b);
+		// the dual cells sharing an edge have to compute the same point, whatever their order of its ends
+		if (SplPoint3(corners[b].x, corners[b].y, corners[b].z) < SplPoint3(corners[a].x, corners[a].y, corners[a].z))
+			std::swap(a, b);
+		if (dist[a]==dist[b]){
+			midVertices[i] = SplPoint3(corners[a].x, corners[a].y, corners[a].z);
+			continue;
+		}
+		Point3 p = corners[a] + (corners[b]-corners[a])*(dist[a]/(dist[a]-dist[b]));
+		midVertices[i] = SplPoint3(p.x, p.y, p.z);
+	}
+	const int *mapMCPtr = GetTrianglesInMap(indexInMap);
+	for (int i=0;i<5;++i){
+		if (*mapMCPtr==-1) break;
+		SplPoint3 vertex1 = midVertices[*mapMCPtr++];
+		SplPoint3 vertex2 = midVertices[*mapMCPtr++];
+		SplPoint3 vertex3 = midVertices[*mapMCPtr++];
+		// the dual cells around the leaves of different levels are degenerated, so are some of their triangles
+		if (vertex1==vertex2 || vertex2==vertex3 || vertex3==vertex1)
+			continue;
+		plist_ptr->vertices[0][0] = vertex1.x;	plist_ptr->vertices[0][1] = vertex1.y;	plist_ptr->vertices[0][2] = vertex1.z;
+		plist_ptr->vertices[1][0] = vertex2.x;	plist_ptr->vertices[1][1] = vertex2.y;	plist_ptr->vertices[1][2] = vertex2.z;
+		plist_ptr->vertices[2][0] = vertex3.x;	plist_ptr->vertices[2][1] = vertex3.y;	plist_ptr->vertices[2][2] = vertex3.z;
+		plist_ptr->next = new Poly ();
+		plist_ptr = plist_ptr->next;
+	}
+}
+
+void MarchingCube::ComputeMCInOctree(const ADFOctree *octree_, Poly *&plist_ptr)
+{
+	octree = octree_;
+	maxLevel = octree->max_depth - lod;
+	ComputeMCInCell(&octree->root, octree->bbox, 0, plist_ptr);
+}
+
+void MarchingCube::ComputeMCInOctreeLeaf(const ADFOctree *octree_, const ADFOctree::Cell *leaf, const Box3 &leafBox, Poly *&plist_ptr)
+{
+	octree = octree_;
+	maxLevel = octree->max_depth;
+	ComputeMCInCell(leaf, leafBox, 0, plist_ptr);
+}
+
+void MarchingCube::AddReflectedPolys(const ADFForest *forest, Poly &plist, Poly *&plist_ptr) const
+{
+	if (forest->GetSymmetryAxis()<0)
+		return;
+	// the other half of a symmetric mesh is the reflection of the triangles (with their order reversed)
+	Poly *last = plist_ptr;
+	for (Poly *p=&plist; p!=last; p=p->next){
+		Point3 v0 = forest->Reflect(Point3(p->vertices[0][0], p->vertices[0][1], p->vertices[0][2]));
+		Point3 v1 = forest->Reflect(Point3(p->vertices[2][0], p->vertices[2][1], p->vertices[2][2]));
+		Point3 v2 = forest->Reflect(Point3(p->vertices[1][0], p->vertices[1][1], p->vertices[1][2]));
+		plist_ptr->vertices[0][0] = v0.x;	plist_ptr->vertices[0][1] = v0.y;	plist_ptr->vertices[0][2] = v0.z;
+		plist_ptr->vertices[1][0] = v1.x;	plist_ptr->vertices[1][1] = v1.y;	plist_ptr->vertices[1][2] = v1.z;
+		plist_ptr->vertices[2][0] = v2.x;	plist_ptr->vertices[2][1] = v2.y;	plist_ptr->vertices[2][2] = v2.z;
+		plist_ptr->next = new Poly ();
+		plist_ptr = plist_ptr->next;
+	}
+}
+
+void MarchingCube::GetMeshFromPolys(Poly &plist, Poly *plist_ptr, Mesh *&mesh) const
+{
+	// the list ends with an unused poly
+	if (plist_ptr==&plist){
+		mesh = new Mesh();
+		return;
+	}
 	Poly *p = &plist;
 	while (p->next!=plist_ptr) p=p->next;
 	p->next = NULL;
@@ -670,48 +1229,139 @@ void MarchingCube::ComputeTree(Node *node, Poly *&plist_ptr, bool bRecursive/*=t
 	}
 }
 
-void MarchingCube::ComputeMCInCell(ADFOctree::Cell *cell, const Box3 &curBbox, Poly *&plist_ptr) const
+void MarchingCube::ComputeMCInCell(const ADFOctree::Cell *cell, const Box3 &curBbox, int level, Poly *&plist_ptr) const
 {
-	if (cell->GetChildPointer(0)){
+	// the whole subtree is on one side of the surface
+	if (!ADFOctree::MayContainSurface(cell))
+		return;
+	if (cell->GetChildPointer(0) && level<maxLevel){
 		// node
 		Box3 childBox;
 		for (int i=0;i<8;++i){
 			GetChildBox(curBbox, childBox, i);
-			ComputeMCInCell(cell->GetChildPointer(i), childBox, plist_ptr);
+			ComputeMCInCell(cell->GetChildPointer(i), childBox, level+1, plist_ptr);
 		}
 	}
 	else{
-		// leaf node	
-		// First compute, the index of the cube in the MarchingCube map
-		float *dist = cell->GetValue()->distances;
-		int indexInMap = 0;	
-		if (dist[0]>=0) indexInMap += 2;	if (dist[1]>=0) indexInMap += 1;
-		if (dist[2]>=0) indexInMap += 4;	if (dist[3]>=0) indexInMap += 8;
-		if (dist[4]>=0) indexInMap += 32;	if (dist[5]>=0) indexInMap += 16;
-		if (dist[6]>=0) indexInMap += 64;	if (dist[7]>=0) indexInMap += 128;
-		if (indexInMap!=0 && indexInMap!=255){
-			// We need to create some triangles, so let's compute the mid-edges vertices
-			SplPoint3 midVertices[12];
-			Point3 minBox = curBbox.Min();
-			Point3 maxBox = curBbox.Max();
-			for (int i=0;i<12;++i)
-				GetMidPoint(minBox, maxBox, midVertices[i], dist, i);
-			// Now, let's add each of the triangles
-			int *mapMCPtr = mapMC+15*indexInMap;
-			for (int i=0;i<5;++i){
-				if (*mapMCPtr==-1) break;
-				int indexVertex1 = *mapMCPtr++;
-				int indexVertex2 = *mapMCPtr++;
-				int indexVertex3 = *mapMCPtr++;
-				SplPoint3 vertex1 = midVertices[indexVertex1];
-				SplPoint3 vertex2 = midVertices[indexVertex2];
-				SplPoint3 vertex3 = midVertices[indexVertex3];
-				plist_ptr->vertices[0][0] = vertex1.x;	plist_ptr->vertices[0][1] = vertex1.y;	plist_ptr->vertices[0][2] = vertex1.z;
-				plist_ptr->vertices[1][0] = vertex2.x;	plist_ptr->vertices[1][1] = vertex2.y;	plist_ptr->vertices[1][2] = vertex2.z;
-				plist_ptr->vertices[2][0] = vertex3.x;	plist_ptr->vertices[2][1] = vertex3.y;	plist_ptr->vertices[2][2] = vertex3.z;
-				plist_ptr->next = new Poly ();
-				plist_ptr = plist_ptr->next;
+		// leaf node, or node at the deepest level of the extraction (all the cells store their corners)
+#ifdef OPTIMIZATIONS_BRICKS
+		const float *brick = (level+ADF_BRICK_LEVELS<=maxLevel) ? octree->GetBrick(curBbox) : NULL;
+		if (brick){
+			ComputeMCInBrick(brick, curBbox, plist_ptr);
+			return;
+		}
+#endif // OPTIMIZATIONS_BRICKS
+		float dist[8];
+#ifdef OPTIMIZATIONS_TRIQUADRATIC
+		// the 27 nodes of the leaf are the corners of its 8 octants, polygonize each of them
+		if (level>=maxLevel){
+			octree->GetCellDistances(cell, curBbox, dist);
+			ComputeMCInLeaf(dist, curBbox.Min(), curBbox.Max(), plist_ptr);
+			return;
+		}
+		float nodes[27];
+		octree->GetCellNodes(cell, curBbox, nodes);
+		Box3 octantBox;
+		for (int i=0;i<8;++i){
+			GetChildBox(curBbox, octantBox, i);
+			ADFOctree::GetOctantDistances(nodes, i, dist);
+			ComputeMCInLeaf(dist, octantBox.Min(), octantBox.Max(), plist_ptr);
+		}
+#else // !OPTIMIZATIONS_TRIQUADRATIC
+		octree->GetCellDistances(cell, curBbox, dist);
+		ComputeMCInLeaf(dist, curBbox.Min(), curBbox.Max(), plist_ptr);
+#endif // !OPTIMIZATIONS_TRIQUADRATIC
+	}
+}
+
+#ifdef OPTIMIZATIONS_BRICKS
+void MarchingCube::ComputeMCInBrick(const float *brick, const Box3 &curBbox, Poly *&plist_ptr) const
+{
+	// classify the sign of all the vertices of the brick first, so that the cells not crossed by the surface
+	// (most of them) are skipped without gathering their distances
+	unsigned char signs[BrickPool::BRICK_SIZE];
+	int i=0;
+#ifdef OPTIMIZATIONS_SSE
+	__m128 zero = _mm_setzero_ps();
+	for (;i+4<=BrickPool::BRICK_SIZE;i+=4){
+		int mask = _mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(brick+i), zero));
+		signs[i] = (unsigned char)(mask&1);		signs[i+1] = (unsigned char)((mask>>1)&1);
+		signs[i+2] = (unsigned char)((mask>>2)&1);	signs[i+3] = (unsigned char)((mask>>3)&1);
+	}
+#endif // OPTIMIZATIONS_SSE
+	for (;i<BrickPool::BRICK_SIZE;++i)
+		signs[i] = brick[i]>=0 ? 1 : 0;
+
+	const int dy = BrickPool::BRICK_VERTICES;
+	const int dz = BrickPool::BRICK_VERTICES*BrickPool::BRICK_VERTICES;
+	Point3 minBrick = curBbox.Min();
+	Point3 step = curBbox.Width()/(float)BrickPool::BRICK_CELLS;
+	for (int z=0;z<BrickPool::BRICK_CELLS;++z){
+		for (int y=0;y<BrickPool::BRICK_CELLS;++y){
+			for (int x=0;x<BrickPool::BRICK_CELLS;++x){
+				const unsigned char *s = signs + BrickPool::GetIndex(x, y, z);
+				int nbPositive = s[0]+s[1]+s[dy]+s[dy+1]+s[dz]+s[dz+1]+s[dz+dy]+s[dz+dy+1];
+				if (nbPositive==0 || nbPositive==8)
+					continue;
+				float dist[8];
+				BrickPool::GetCellDistances(brick, x, y, z, dist);
+				Point3 minBox(minBrick.x+x*step.x, minBrick.y+y*step.y, minBrick.z+z*step.z);
+				ComputeMCInLeaf(dist, minBox, minBox+step, plist_ptr);
 			}
 		}
 	}
 }
+#endif // OPTIMIZATIONS_BRICKS
+
+int MarchingCube::GetIndexInMap(const float dist[8])
+{
+	int indexInMap = 0;	
+	if (dist[0]>=0) indexInMap += 2;	if (dist[1]>=0) indexInMap += 1;
+	if (dist[2]>=0) indexInMap += 4;	if (dist[3]>=0) indexInMap += 8;
+	if (dist[4]>=0) indexInMap += 32;	if (dist[5]>=0) indexInMap += 16;
+	if (dist[6]>=0) indexInMap += 64;	if (dist[7]>=0) indexInMap += 128;
+	return indexInMap;
+}
+
+const int *MarchingCube::GetTrianglesInMap(int indexInMap)
+{
+	return mapMC+15*indexInMap;
+}
+
+void MarchingCube::GetEdgeCorners(int edge, int &a, int &b)
+{
+	// same edges as GetMidPoint
+	static const int edgeCorners[12][2] = {
+		{0,1}, {0,2}, {2,3}, {1,3}, {4,5}, {4,6}, {6,7}, {5,7}, {1,5}, {0,4}, {3,7}, {2,6}
+	};
+	a = edgeCorners[edge][0];
+	b = edgeCorners[edge][1];
+}
+
+void MarchingCube::ComputeMCInLeaf(const float dist[8], const Point3 &minBox, const Point3 &maxBox, Poly *&plist_ptr) const
+{
+	// First compute, the index of the cube in the MarchingCube map
+	int indexInMap = GetIndexInMap(dist);
+	if (indexInMap!=0 && indexInMap!=255){
+		// We need to create some triangles, so let's compute the mid-edges vertices
+		SplPoint3 midVertices[12];
+		for (int i=0;i<12;++i)
+			GetMidPoint(minBox, maxBox, midVertices[i], dist, i);
+		// Now, let's add each of the triangles
+		int *mapMCPtr = mapMC+15*indexInMap;
+		for (int i=0;i<5;++i){
+			if (*mapMCPtr==-1) break;
+			int indexVertex1 = *mapMCPtr++;
+			int indexVertex2 = *mapMCPtr++;
+			int indexVertex3 = *mapMCPtr++;
+			SplPoint3 vertex1 = midVertices[indexVertex1];
+			SplPoint3 vertex2 = midVertices[indexVertex2];
+			SplPoint3 vertex3 = midVertices[indexVertex3];
+			plist_ptr->vertices[0][0] = vertex1.x;	plist_ptr->vertices[0][1] = vertex1.y;	plist_ptr->vertices[0][2] = vertex1.z;
+			plist_ptr->vertices[1][0] = vertex2.x;	plist_ptr->vertices[1][1] = vertex2.y;	plist_ptr->vertices[1][2] = vertex2.z;
+			plist_ptr->vertices[2][0] = vertex3.x;	plist_ptr->vertices[2][1] = vertex3.y;	plist_ptr->vertices[2][2] = vertex3.z;
+			plist_ptr->next = new Poly ();
+			plist_ptr = plist_ptr->next;
+		}
+	}
+}
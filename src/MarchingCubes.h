@@ -21,12 +21,97 @@ typedef struct node Node;
 class MarchingCube
 {
 private:
-	void ComputeMCInCell(ADFOctree::Cell *cell, const Box3 &curBbox, Poly *&plist_ptr) const;
+	const ADFOctree *octree;
+	// number of the finest levels of the octrees skipped by the extraction, and the resulting deepest level polygonized:
+	// the cells at this level are polygonized as leaves, from the distances at their corners
+	int lod;
+	int maxLevel;
+
+	// Node of the traversal of the dual grid of a forest: a cell of one of the roots (the bricks and the triquadratic
+	// leaves are split into 'virtualLevels' more levels of virtual cells). Around the forest, the cells of the roots
+	// on its boundary stand for the missing neighbours too, with their dual vertex flattened onto the faces of the
+	// box of the forest (flat[axis] is -1, or 0/1 for the min/max face)
+	struct DualNode{
+		const ADFOctree *octree;
+		const ADFOctree::Cell *cell;
+		Box3 box;
+		int level;
+		int virtualLevels;
+		int flat[3];
+	};
+	// dual cells found by the traversal, as indices of their 8 dual vertices
+	Box3 dualBox;
+	std::map<SplPoint3, int> dualVertices;
+	std::vector<Point3> dualPoints;
+	std::vector<int> dualCells;
+	// with the dual contouring, the traversal gives the minimal edges of the octrees instead: the 4 leaves around
+	// each edge (their vertex is flattened as the dual nodes), and the indices of its ends in dualPoints
+	struct ContourEdge{
+		int cells[4];
+		int flat[4][3];
+		int axis;
+		int ends[2];
+	};
+	bool bContouring;
+	std::map<SplPoint3, int> contourCells;
+	std::vector<Box3> contourBoxes;
+	std::vector<ContourEdge> contourEdges;
+
+	void ComputeMCInCell(const ADFOctree::Cell *cell, const Box3 &curBbox, int level, Poly *&plist_ptr) const;
+#ifdef OPTIMIZATIONS_BRICKS
+	void ComputeMCInBrick(const float *brick, const Box3 &curBbox, Poly *&plist_ptr) const;
+#endif // OPTIMIZATIONS_BRICKS
+	// the procedures of the dual grid traversal, on a node, two nodes sharing a face, four nodes sharing
+	// an edge along 'axis', and eight nodes sharing a vertex (which give a dual cell once they are all leaves)
+	bool IsDualLeaf(const DualNode &node) const;
+	static int GetVirtualLevels(const DualNode &node);
+	DualNode GetDualChild(const DualNode &node, int i) const;
+	void DualNodeProc(const DualNode &node);
+	void DualFaceProc(const DualNode &n0, const DualNode &n1, int axis);
+	void DualEdgeProc(const DualNode nodes[4], int axis);
+	void DualVertProc(const DualNode nodes[8]);
+	int GetDualVertex(const DualNode &node);
+	int GetDualPoint(const Point3 &p);
+	int GetContourCell(const DualNode &node);
+	void AddContourEdge(const DualNode nodes[4], int axis);
+	// walk the dual grid of all the roots of a forest
+	void WalkDualGrid(const ADFForest *forest);
+	// Add the triangles of a dual cell, from the positions of its corners and the distances there
+	void ComputeMCInDualCell(const float dist[8], const Point3 corners[8], Poly *&plist_ptr) const;
 
 public:
-	MarchingCube(){}
+	MarchingCube():octree(NULL),lod(0),maxLevel(0),bContouring(false){}
 	~MarchingCube(){}
 
-	void GetMeshFromOctree(ADFOctree::Cell *root, const Box3 &curBbox, Mesh *&mesh);
+	// Skip the 'lod_' finest levels of the octrees in the next extractions from a forest or a whole octree, for a
+	// cheaper and coarser mesh from the same distance fields (the leaves given while an octree is filled are
+	// always polygonized at their own level)
+	void SetLOD(int lod_){lod = max(0, lod_);}
+	int GetLOD() const{return lod;}
+
+	void GetMeshFromForest(const ADFForest *forest, Mesh *&mesh);
+	// Same as GetMeshFromForest with the dual marching cubes: the cubes join the centers of the leaves around each
+	// vertex of the octrees, so the surface stays watertight where the leaves change of level
+	void GetDualMeshFromForest(const ADFForest *forest, Mesh *&mesh);
+	// Same as GetMeshFromForest with the dual contouring: each leaf crossed by the surface gets one vertex, placed
+	// from the closest points and normals of the mesh (the Hermite data) on the edges crossed by the surface around
+	// it, so the sharp features are kept by large leaves. The leaves around each crossed edge give a quad.
+	void GetDualContourFromForest(const ADFForest *forest, Mesh *&mesh);
+	// Add the triangles of a whole octree, or of a single leaf of it (while the octree is filled, see
+	// ADFOctree::FillAndPolygonize), to the list of polys
+	void ComputeMCInOctree(const ADFOctree *octree_, Poly *&plist_ptr);
+	void ComputeMCInOctreeLeaf(const ADFOctree *octree_, const ADFOctree::Cell *leaf, const Box3 &leafBox, Poly *&plist_ptr);
+	// Add the reflection of the polys of the half of a symmetric forest ('plist_ptr' is the unused poly ending the list)
+	void AddReflectedPolys(const ADFForest *forest, Poly &plist, Poly *&plist_ptr) const;
+	// Add the triangles of a cell to the list of polys, from the distances at its corners
+	void ComputeMCInLeaf(const float dist[8], const Point3 &minBox, const Point3 &maxBox, Poly *&plist_ptr) const;
+	// Get the case of a cell in the marching cubes map from the distances at its corners (0 or 255 if not crossed)
+	static int GetIndexInMap(const float dist[8]);
+	// Get the triangles of a case of the map, as indices of the edges of the cell (3 per triangle, -1 after the last one)
+	static const int *GetTrianglesInMap(int indexInMap);
+	// Get the corners of a cell at the ends of one of its 12 edges (corner = x + 2*y + 4*z, a < b)
+	static void GetEdgeCorners(int edge, int &a, int &b);
+	// Build the mesh of a list of polys filled by ComputeMCInLeaf ('plist_ptr' is the unused poly ending the list)
+	void GetMeshFromPolys(Poly &plist, Poly *plist_ptr, Mesh *&mesh) const;
 	void ComputeTree(Node *node, Poly *&plist_ptr, bool bRecursive=true) const;
 };
\ No newline at end of file
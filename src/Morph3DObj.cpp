@@ -104,7 +104,7 @@ static ParamBlockDescID descVer0[] = {
 #define PBLOCK_LENGTH	1
 #define CURRENT_VERSION	1
 
-Morph3DObj::Morph3DObj(BOOL loading) : currentMesh(NULL)
+Morph3DObj::Morph3DObj(BOOL loading) : currentMesh(NULL), currentLOD(0)
 {
 	MakeRefByID(FOREVER, REF_PBLOCK, CreateParameterBlock(descVer0, PBLOCK_LENGTH, CURRENT_VERSION));	
 	pblock->SetValue(PB_COEFF, 0, 0);
@@ -553,11 +553,45 @@ Mesh* Morph3DObj::GetRenderMesh(TimeValue t, INode *inode, View& view, BOOL& nee
 			}
 		}
 	}
-	UpdateMesh(t);
+#ifdef MORPH_VIEW_DEPENDENT_LOD
+	// the meshes of each level of detail are kept by the engine, the instances of the same size share them
+	UpdateMesh(t,FALSE,FALSE,GetRenderLOD(t,inode,view));
+#else
+	UpdateMesh(t,FALSE,FALSE,0);
+#endif
 	needDelete = FALSE;
 	return currentMesh ? currentMesh : NULL;	
 }
 
+int Morph3DObj::GetRenderLOD(TimeValue t, INode *inode, View& view)
+{
+	// the in-between mesh stays in the box of the operands
+	Box3 box, abox;
+	box.Init();
+	Matrix3 objTM = inode->GetObjectTM(t);
+	Object *ob;
+	for (int i=0;i<2;++i){
+		if (ob=GetPipeObj(t,i)) {
+			Matrix3 mat = GetOpTM(t,i) * objTM;
+			ob->GetDeformBBox(t,abox,&mat);
+			box += abox;
+		}
+	}
+	if (box.IsEmpty())
+		return 0;
+	Point2 minScreen(1e30f, 1e30f), maxScreen(-1e30f, -1e30f);
+	for (int i=0;i<8;++i){
+		Point3 p = box[i] * view.worldToView;
+		// the box crosses the plane of the camera: its size on the screen is unbounded
+		if (view.projType==PROJ_PERSPECTIVE && p.z>=0.f)
+			return 0;
+		Point2 s = view.ViewToScreen(p);
+		minScreen.x = min(minScreen.x, s.x);	maxScreen.x = max(maxScreen.x, s.x);
+		minScreen.y = min(minScreen.y, s.y);	maxScreen.y = max(maxScreen.y, s.y);
+	}
+	return MorphEngine::Instance()->GetLODFromScreenSize(max(maxScreen.x-minScreen.x, maxScreen.y-minScreen.y));
+}
+
 int Morph3DObj::HitTest(TimeValue t, INode* inode, int type, int crossing, int flags, 
 						IPoint2 *p, ViewExp *vpt)
 {
@@ -1192,8 +1226,11 @@ int DllExport CalcMorphMesh(Mesh &meshOut, Mesh &mesh1, Mesh &mesh2, int resolut
 }
 */
 
-BOOL Morph3DObj::UpdateMesh(TimeValue t,BOOL force,BOOL sel)
+BOOL Morph3DObj::UpdateMesh(TimeValue t,BOOL force,BOOL sel,int lod)
 {
+	if (lod<0)
+		lod = TestFlag(MORPH_INRENDER) ? 0 : MORPH_VIEWPORT_LOD;
+
 	if (MorphEngine::Instance()->IsInitialized() && MorphEngine::Instance()->AnchorListSize()>4){
 		MorphEngine::Instance()->ValidateAnchorPoints();
 		MorphEngine::Instance()->SetMorphingMode(EMT_RigidOnly);
@@ -1201,7 +1238,8 @@ BOOL Morph3DObj::UpdateMesh(TimeValue t,BOOL force,BOOL sel)
 	else
 		MorphEngine::Instance()->SetMorphingMode(EMT_None);
 
-	if (((!ivalid.InInterval(t) || TestFlag(MORPH_NEEDSUPDATE)) &&
+	// the meshes of both levels of detail stay in the cache of the engine, switching between them is cheap
+	if (((!ivalid.InInterval(t) || TestFlag(MORPH_NEEDSUPDATE) || lod!=currentLOD) &&
 		(TestFlag(MORPH_UPDATEALWAYS) || 
 		(TestFlag(MORPH_UPDATESELECT)& sel) || 
 		(TestFlag(MORPH_UPDATERENDER) && TestFlag(MORPH_INRENDER)) ||
@@ -1217,22 +1255,26 @@ BOOL Morph3DObj::UpdateMesh(TimeValue t,BOOL force,BOOL sel)
 		tob1 = GetTriObject(t,ob1,ivalid,needsDel1);
 		tob2 = GetTriObject(t,ob2,ivalid,needsDel2);
 
-		if (tob1 && !MorphEngine::Instance()->GetMesh1()){
+		// the operands are given in their local space, an animated operand is updated around its moved faces only
+		// and moving an operand only changes its transform
+		if (tob1){
 			Mesh *m = &tob1->GetMesh();
 			m->buildBoundingBox();
-			Box3 box = m->getBoundingBox();
-			box.pmin = GetOpTM(ip ? ip->GetTime() : 0, 0) * box.pmin;
-			box.pmax = GetOpTM(ip ? ip->GetTime() : 0, 0) * box.pmax;
-			MorphEngine::Instance()->SetMesh1(m, box);
+			Matrix3 tm = GetOpTM(t, 0, &ivalid);
+			if (!MorphEngine::Instance()->GetMesh1())
+				MorphEngine::Instance()->SetMesh1(m, tm);
+			else
+				MorphEngine::Instance()->UpdateMesh1(m, tm);
 		}
 
-		if (tob2 && !MorphEngine::Instance()->GetMesh2()){
+		if (tob2){
 			Mesh *m = &tob2->GetMesh();
 			m->buildBoundingBox();
-			Box3 box = m->getBoundingBox();
-			box.pmin = GetOpTM(ip ? ip->GetTime() : 0, 1) * box.pmin;
-			box.pmax = GetOpTM(ip ? ip->GetTime() : 0, 1) * box.pmax;
-			MorphEngine::Instance()->SetMesh2(m, box);
+			Matrix3 tm = GetOpTM(t, 1, &ivalid);
+			if (!MorphEngine::Instance()->GetMesh2())
+				MorphEngine::Instance()->SetMesh2(m, tm);
+			else
+				MorphEngine::Instance()->UpdateMesh2(m, tm);
 		}
 
 		if (tob1 && tob2) {
@@ -1243,7 +1285,7 @@ BOOL Morph3DObj::UpdateMesh(TimeValue t,BOOL force,BOOL sel)
 			GetAsyncKeyState(VK_ESCAPE);
 			ClearFlag(MORPH_ABORTED);
 			pblock->GetValue(PB_COEFF, t, coeff, ivalid);
-			bool res = MorphEngine::Instance()->GetResultMesh(currentMesh, coeff);
+			bool res = MorphEngine::Instance()->GetResultMesh(currentMesh, coeff, NULL, lod);
 			SetCursor(hCur);
 			if (!res) {
 				// Morphing Interpolation Failed!!!
@@ -1273,6 +1315,7 @@ BOOL Morph3DObj::UpdateMesh(TimeValue t,BOOL force,BOOL sel)
 			} else {
 				if (ip) ip->DisplayTempPrompt(GetString(IDS_RB_MORPHCOMPLETED),500);
 				ClearFlag(MORPH_FIRSTUPDATE);
+				currentLOD = lod;
 				currentMesh->InvalidateEdgeList();
 				currentMesh->InvalidateGeomCache();
 				currentMesh->InvalidateTopologyCache();
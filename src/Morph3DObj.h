@@ -62,6 +62,13 @@ extern HINSTANCE hInst3DSMax;
 
 //#define MORPH_SMOOTH			(1<<12)
 
+// Number of the finest levels of the distance fields skipped by the mesh of the viewports (0 for the full resolution
+// of the render)
+#define MORPH_VIEWPORT_LOD		1
+
+// comment this line to render the morph at the full resolution whatever its size on the screen
+#define MORPH_VIEW_DEPENDENT_LOD
+
 
 //--- ClassDescriptor and class vars ---------------------------------
 
@@ -99,6 +106,7 @@ public:
 	
 	int selLevel;
 	Mesh *currentMesh;
+	int currentLOD;
 	
 	int version;
 	IParamBlock *pblock;
@@ -138,7 +146,9 @@ public:
 
 	void SetOperandA (TimeValue t, INode *node);
 	void SetOperandB (TimeValue t, INode *node, INode *boolNode, int addOpMethod=0, int matMergeMethod=0, bool *canUndo=NULL);
-	BOOL UpdateMesh(TimeValue t,BOOL force=FALSE,BOOL sel=FALSE);
+	// 'lod' is the level of detail of the mesh (see MorphEngine::GetResultMesh), -1 for the full resolution in
+	// the render and MORPH_VIEWPORT_LOD otherwise
+	BOOL UpdateMesh(TimeValue t,BOOL force=FALSE,BOOL sel=FALSE,int lod=-1);
 	Object *GetPipeObj(TimeValue t,int which);
 	Matrix3 GetOpTM(TimeValue t,int which,Interval *iv=NULL);
 	void Invalidate() {ivalid.SetEmpty();}
@@ -190,6 +200,8 @@ public:
 	ObjectHandle CreateTriObjRep(TimeValue t){return NULL;}  // for rendering, also for deformation
 	int IntersectRay(TimeValue t, Ray& r, float& at, Point3& norm);
 	Mesh* GetRenderMesh(TimeValue t, INode *inode, View& view, BOOL& needDelete);
+	// level of detail of the render mesh, from the size of the box of the operands on the screen
+	int GetRenderLOD(TimeValue t, INode *inode, View& view);
 
 	// Animatable methods
 	Class_ID ClassID() {return Morph3DObjClassDesc::Instance()->ClassID();}  
@@ -16,26 +16,231 @@
 #include "StdAfx.h"
 #include "Max.h"
 #include "MorphEngine.h"
+#include "Distance.h"
 #include <fstream>
 #include "MemoryManager.h"
 #include "MorphEngineDefines.h"
 #include <algorithm>
+#include <set>
 #include "MarchingCubes.h"
+#include "PlaneSets.h"
 #include "mesh.h"
 #include "SVD/svdlib.h"
 #include "WarpTransform.h"
+#ifdef OPTIMIZATIONS_SSE
+#include <xmmintrin.h>
+#endif // OPTIMIZATIONS_SSE
 
-MorphEngine::MeshMorpher::MeshMorpher(Mesh *mesh_, Box3 realBox_, int max_depth_, double min_error_, int min_faces_for_subdivide_)
+namespace{
+	// Blend the distances at the 8 corners of a cell, blended = d1 + coeff*(d2-d1) ('diff' is d2-d1),
+	// and return the smallest absolute value of the blend
+	inline float BlendCorners(const float d1[8], const float diff[8], float coeff, float blended[8])
+	{
+#ifdef OPTIMIZATIONS_SSE
+		__m128 t = _mm_set1_ps(coeff);
+		__m128 lo = _mm_add_ps(_mm_loadu_ps(d1), _mm_mul_ps(t, _mm_loadu_ps(diff)));
+		__m128 hi = _mm_add_ps(_mm_loadu_ps(d1+4), _mm_mul_ps(t, _mm_loadu_ps(diff+4)));
+		_mm_storeu_ps(blended, lo);
+		_mm_storeu_ps(blended+4, hi);
+		__m128 signMask = _mm_set1_ps(-0.f);
+		__m128 m = _mm_min_ps(_mm_andnot_ps(signMask, lo), _mm_andnot_ps(signMask, hi));
+		m = _mm_min_ps(m, _mm_movehl_ps(m, m));
+		m = _mm_min_ss(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1,1,1,1)));
+		float minDist;
+		_mm_store_ss(&minDist, m);
+		return minDist;
+#else
+		float minDist = 1e30f;
+		for (int i=0;i<8;++i){
+			blended[i] = d1[i] + coeff*diff[i];
+			minDist = min(minDist, abs(blended[i]));
+		}
+		return minDist;
+#endif // OPTIMIZATIONS_SSE
+	}
+
+	// Gather the distances of the operands at the corners of a cell of the grid of the in-between meshes, as
+	// d1 and diff = d2-d1 for BlendCorners
+	inline void GetCornerSamples(const std::map<LatticePoint, BlendSample> &samples, const LatticePoint &cell, int size, float d1[8], float diff[8])
+	{
+		for (int i=0;i<8;++i){
+			LatticePoint lp(cell.x+((i&1) ? size : 0), cell.y+((i&2) ? size : 0), cell.z+((i&4) ? size : 0));
+			const BlendSample &s = samples.find(lp)->second;
+			d1[i] = s.d1;
+			diff[i] = s.d2-s.d1;
+		}
+	}
+
+	// Add the triangles of a case of the marching cubes map in a cell of the grid, as edges of the grid
+	void AddCellTriangles(const LatticePoint &cell, int indexInMap, std::vector<GridEdge> &triangles)
+	{
+		const int *edges = MarchingCube::GetTrianglesInMap(indexInMap);
+		for (int i=0;i<15 && edges[i]!=-1;++i){
+			int a, b;
+			MarchingCube::GetEdgeCorners(edges[i], a, b);
+			LatticePoint lp(cell.x+(a&1), cell.y+((a>>1)&1), cell.z+((a>>2)&1));
+			triangles.push_back(GridEdge(lp, b-a==1 ? 0 : (b-a==2 ? 1 : 2)));
+		}
+	}
+
+	// Get the point of an edge of the grid where the blend of the distances is 0
+	Point3 GetEdgeVertex(const std::map<LatticePoint, BlendSample> &samples, const GridEdge &edge, float coeff, const Point3 &minBox, const Point3 &step)
+	{
+		LatticePoint q = edge.p;
+		if (edge.axis==0) ++q.x;
+		else if (edge.axis==1) ++q.y;
+		else ++q.z;
+		const BlendSample &s0 = samples.find(edge.p)->second;
+		const BlendSample &s1 = samples.find(q)->second;
+		float a = s0.d1 + coeff*(s0.d2-s0.d1);
+		float b = s1.d1 + coeff*(s1.d2-s1.d1);
+		// the blend changes of sign along the edge, so a!=b
+		Point3 p = minBox + Point3((float)edge.p.x*step.x, (float)edge.p.y*step.y, (float)edge.p.z*step.z);
+		p[edge.axis] += a/(a-b)*step[edge.axis];
+		return p;
+	}
+
+	// Build the mesh of triangles given as edges of the grid (3 per triangle), from the index of the vertex of each edge
+	Mesh *GetEdgeMesh(const std::vector<GridEdge> &triangles, std::map<GridEdge, int> &vertices,
+					  const std::map<LatticePoint, BlendSample> &samples, float coeff, const Point3 &minBox, const Point3 &step)
+	{
+		Mesh *mesh = new Mesh();
+		mesh->setNumVerts((int)vertices.size());
+		mesh->setNumFaces((int)triangles.size()/3);
+		for (std::map<GridEdge, int>::const_iterator it=vertices.begin();it!=vertices.end();++it)
+			mesh->setVert(it->second, GetEdgeVertex(samples, it->first, coeff, minBox, step));
+		for (size_t i=0;i+2<triangles.size();i+=3){
+			// same orientation as MarchingCube::GetMeshFromPolys
+			Face &f = mesh->faces[i/3];
+			f.setVerts(vertices[triangles[i]], vertices[triangles[i+2]], vertices[triangles[i+1]]);
+			f.setEdgeVisFlags(1,1,1);
+			f.setSmGroup(1);
+		}
+		return mesh;
+	}
+
+	// Check if the surface crosses a face of a cell (0/1 for -x/+x, 2/3 for -y/+y, 4/5 for -z/+z), from the
+	// distances at its corners: the marching cubes surface only leaves a cell through the faces with both signs
+	inline bool IsFaceCrossed(const float dist[8], int face)
+	{
+		int axisBit = 1<<(face>>1);
+		int side = (face&1) ? axisBit : 0;
+		int nbPositive = 0;
+		for (int i=0;i<8;++i)
+			if ((i&axisBit)==side && dist[i]>=0) ++nbPositive;
+		return nbPositive!=0 && nbPositive!=4;
+	}
+
+	// The blend at a vertex of the grid is linear in the coefficient: if all the vertices have the same signs
+	// at t0 and t1, they keep them between the two and so do the cases of the cells
+	bool SameSigns(const std::vector<BlendSample> &corners, float t0, float t1)
+	{
+		for (size_t i=0;i<corners.size();++i){
+			float diff = corners[i].d2-corners[i].d1;
+			if ((corners[i].d1+t0*diff>=0) != (corners[i].d1+t1*diff>=0))
+				return false;
+		}
+		return true;
+	}
+
+	// Bisect the sorted coefficients [lo, hi] to find the consecutive ones between which the topology changes
+	void FindTopologyChanges(const std::vector<BlendSample> &corners, const std::vector<std::pair<float, int> > &coeffs,
+							 int lo, int hi, std::vector<bool> &bChange)
+	{
+		if (hi<=lo || SameSigns(corners, coeffs[lo].first, coeffs[hi].first))
+			return;
+		if (hi==lo+1){
+			bChange[lo] = true;
+			return;
+		}
+		int mid = (lo+hi)/2;
+		FindTopologyChanges(corners, coeffs, lo, mid, bChange);
+		FindTopologyChanges(corners, coeffs, mid, hi, bChange);
+	}
+
+	// Check if a transform mirrors the space (its determinant is negative)
+	inline bool IsMirror(const Matrix3 &tm)
+	{
+		return DotProd(CrossProd(tm.GetRow(0), tm.GetRow(1)), tm.GetRow(2))<0.f;
+	}
+
+	// Place the vertices of a mesh with a transform, the faces of a mirrored mesh are turned over to keep
+	// their normals outside (vertices 1 and 2 swap)
+	void BakeTransform(Mesh *mesh, const Matrix3 &tm)
+	{
+		int nbVerts = mesh->getNumVerts();
+		for (int i=0;i<nbVerts;++i)
+			mesh->verts[i] = tm*mesh->verts[i];
+		if (IsMirror(tm)){
+			int nbFaces = mesh->getNumFaces();
+			for (int i=0;i<nbFaces;++i){
+				Face &f = mesh->faces[i];
+				f.setVerts(f.getVert(0), f.getVert(2), f.getVert(1));
+			}
+		}
+		mesh->buildBoundingBox();
+	}
+}
+
+MorphEngine::MeshMorpher::MeshMorpher(Mesh *mesh_, const Matrix3 &tm_, int max_depth_, const ADFRefinement &refinement_,
+									  const std::vector<RegionOfInterest> &regions_, ESymmetry symmetry, int min_faces_for_subdivide_)
 {
 	mesh = new Mesh(*mesh_);
+	// the octrees go down to the deepest region of interest, max_depth_ only applies outside of the regions
 	max_depth = max_depth_;
-	min_error = min_error_;
-	realBox = realBox_;
-	bbox = mesh->getBoundingBox();
-	InitBox(mesh->getBoundingBox(),max_depth_);
+	for (std::vector<RegionOfInterest>::const_iterator it=regions_.begin(); it!=regions_.end(); ++it)
+		max_depth = max(max_depth, it->max_depth);
+	// a distance field can only be scaled uniformly: a transform which isn't a similarity is baked into the
+	// mesh, the octrees are then built in the space of the morphing (and so are the regions of interest)
+	std::vector<RegionOfInterest> regions(regions_);
+	bakedTM = tm_;
+	bBakedTM = !IsSimilarity(tm_);
+	if (bBakedTM){
+		BakeTransform(mesh, tm_);
+		for (size_t i=0;i<regions.size();++i){
+			Box3 box;
+			for (int j=0;j<8;++j)
+				box += tm_*regions[i].box[j];
+			regions[i].box = box;
+		}
+		tm.IdentityMatrix();
+	}
+	else
+		tm = tm_;
+	Box3 meshBox = mesh->getBoundingBox();
+
+	int symmetryAxis = -1;
+	float symmetryPlane = 0.f;
+	if (symmetry==ES_Auto)
+		DetectSymmetry(*mesh, ADF_SYMMETRY_TOLERANCE*meshBox.Width().Length(), symmetryAxis, symmetryPlane);
+	else if (symmetry!=ES_None){
+		symmetryAxis = (int)symmetry;
+		symmetryPlane = meshBox.Center()[symmetryAxis];
+	}
+	if (symmetryAxis>=0){
+		// the distances above the plane only depend on the faces reaching it
+		int nbFaces = mesh->getNumFaces();
+		for (int i=0;i<nbFaces;++i){
+			for (int j=0;j<3;++j){
+				if (mesh->verts[mesh->faces[i].getVert(j)][symmetryAxis]>=symmetryPlane){
+					halfFaces.push_back(i);
+					break;
+				}
+			}
+		}
+	}
+
+	// the ADF is a forest of cubes tiling the box of the mesh, the FaceOctree is a cube containing the forest:
+	// the roots stick out of the mesh box, and a sample outside of the FaceOctree would read a distance of 0
 	min_faces = min_faces_for_subdivide_;
-	octree = new ADFOctree(bbox, max_depth, min_error);
+	forest = new ADFForest(meshBox, ADF_MAX_ROOTS, max_depth, refinement_, symmetryAxis, symmetryPlane);
+	InitBox(forest->GetBBox(),max_depth);
+	assert(bbox.Contains(forest->GetBBox()));
 	fOctree = new FaceOctree(bbox, max_depth, min_faces_for_subdivide_);
+	forest->SetRegionsOfInterest(regions, max_depth_);
+	fOctree->SetRegionsOfInterest(regions, max_depth_);
+	// the proxy of the root cells, each finer proxy is twice as accurate
+	proxy_error = refinement_.proxy_ratio*refinement_.relative_error*forest->GetRoot(0)->GetBBox().Width().Length();
 	numFaces = mesh->getNumFaces();
 	numVertices = mesh->getNumVerts();
 	avgNormals.verticeNormal = NULL;
@@ -44,6 +249,143 @@ MorphEngine::MeshMorpher::MeshMorpher(Mesh *mesh_, Box3 realBox_, int max_depth_
 	bInit = false;
 }
 
+bool MorphEngine::MeshMorpher::HasMoved(const Mesh *m) const
+{
+	if (m->getNumVerts()!=numVertices || m->getNumFaces()!=numFaces)
+		return true;
+	// 'm' is given in the local space, the mesh of a baked transform is placed (and turned over if mirrored)
+	for (int i=0;i<numVertices;++i){
+		if ((bBakedTM ? bakedTM*m->verts[i] : m->verts[i])!=mesh->verts[i])
+			return true;
+	}
+	bool bFlipped = bBakedTM && IsMirror(bakedTM);
+	for (int i=0;i<numFaces;++i){
+		for (int j=0;j<3;++j){
+			if (m->faces[i].getVert(j)!=mesh->faces[i].getVert(bFlipped ? (3-j)%3 : j))
+				return true;
+		}
+	}
+	return false;
+}
+
+bool MorphEngine::MeshMorpher::Update(const Mesh *m)
+{
+	// the octrees of a baked transform aren't in the local space of 'm', they are built again
+	if (!bInit || bBakedTM || !halfFaces.empty() || m->getNumVerts()!=numVertices || m->getNumFaces()!=numFaces)
+		return false;
+	for (int i=0;i<numFaces;++i){
+		for (int j=0;j<3;++j){
+			if (m->faces[i].getVert(j)!=mesh->faces[i].getVert(j))
+				return false;
+		}
+	}
+	// the octrees can't grow, the vertices must stay inside the forest
+	Box3 forestBox = forest->GetBBox();
+	std::vector<bool> moved(numVertices, false);
+	for (int i=0;i<numVertices;++i){
+		if (m->verts[i]==mesh->verts[i])
+			continue;
+		if (!forestBox.Contains(m->verts[i]))
+			return false;
+		moved[i] = true;
+	}
+
+	// the faces around the moved vertices, with their boxes before and after the move
+	std::vector<int> movedFaces;
+	std::vector<Box3> movedBoxes;
+	for (int i=0;i<numFaces;++i){
+		int i0 = mesh->faces[i].getVert(0);
+		int i1 = mesh->faces[i].getVert(1);
+		int i2 = mesh->faces[i].getVert(2);
+		if (!moved[i0] && !moved[i1] && !moved[i2])
+			continue;
+		movedFaces.push_back(i);
+		Box3 oldBox, newBox;
+		oldBox.Init();
+		oldBox += mesh->verts[i0];	oldBox += mesh->verts[i1];	oldBox += mesh->verts[i2];
+		newBox.Init();
+		newBox += m->verts[i0];	newBox += m->verts[i1];	newBox += m->verts[i2];
+		movedBoxes.push_back(oldBox);
+		movedBoxes.push_back(newBox);
+	}
+	if (movedFaces.empty())
+		return true;
+
+	for (int i=0;i<numVertices;++i){
+		if (moved[i])
+			mesh->verts[i] = m->verts[i];
+	}
+	mesh->buildBoundingBox();
+	// the proxies were simplified from the previous position of the mesh
+	FreeProxies();
+	ComputeAveragedNormals(mesh, avgNormals);
+	fOctree->Refit(movedFaces);
+	forest->Update(movedBoxes);
+	return true;
+}
+
+void MorphEngine::MeshMorpher::GetDistances(const Point3 *points, int nbPoints, float *distances, Point3 *gradients) const
+{
+	Matrix3 invTM = Inverse(tm);
+	std::vector<Point3> localPoints(nbPoints);
+	for (int i=0;i<nbPoints;++i)
+		localPoints[i] = invTM*points[i];
+	if (nbPoints)
+		forest->GetDistances(&localPoints[0], nbPoints, distances, gradients);
+	// the field is stored in local units
+	float scale = GetScale();
+	for (int i=0;i<nbPoints;++i)
+		distances[i] *= scale;
+	if (!gradients)
+		return;
+	// the gradient of the local field along an axis of the space of the morphing is the projection on the
+	// image of this axis in the local space, ie the rows of the inverse transform
+	Point3 rows[3] = {scale*invTM.GetRow(0), scale*invTM.GetRow(1), scale*invTM.GetRow(2)};
+	for (int i=0;i<nbPoints;++i){
+		Point3 g = gradients[i];
+		gradients[i] = Point3(DotProd(g, rows[0]), DotProd(g, rows[1]), DotProd(g, rows[2]));
+	}
+}
+
+float MorphEngine::MeshMorpher::GetScale() const
+{
+	// the transforms which aren't similarities are baked into the mesh, the rows have the same length
+	return Length(tm.GetRow(0));
+}
+
+bool MorphEngine::MeshMorpher::IsSimilarity(const Matrix3 &tm)
+{
+	Point3 rows[3] = {tm.GetRow(0), tm.GetRow(1), tm.GetRow(2)};
+	float scales[3] = {Length(rows[0]), Length(rows[1]), Length(rows[2])};
+	float scale = (scales[0]+scales[1]+scales[2])/3.f;
+	float tolerance = 1e-3f*scale;
+	for (int i=0;i<3;++i){
+		if (fabs(scales[i]-scale)>tolerance || fabs(DotProd(rows[i], rows[(i+1)%3]))>tolerance*scale)
+			return false;
+	}
+	return true;
+}
+
+bool MorphEngine::MeshMorpher::SetTM(const Matrix3 &tm_)
+{
+	if (bBakedTM || !IsSimilarity(tm_))
+		return false;
+	tm = tm_;
+	return true;
+}
+
+void MorphEngine::MeshMorpher::GetDistanceBounds(const Box3 &box, float &minDist, float &maxDist) const
+{
+	Matrix3 invTM = Inverse(tm);
+	Box3 localBox;
+	for (int i=0;i<8;++i)
+		localBox += invTM*box[i];
+	forest->GetDistanceBounds(localBox, minDist, maxDist);
+	float scale = GetScale();
+	minDist *= scale;
+	maxDist *= scale;
+}
+
 void MorphEngine::MeshMorpher::InitBox(const Box3 &bbox_, int maxDepth)
 {
 	Point3 width = bbox_.Width();
@@ -56,27 +398,238 @@ void MorphEngine::MeshMorpher::InitBox(const Box3 &bbox_, int maxDepth)
 	bbox = Box3(center-newHalfWidth, center+newHalfWidth);
 }
 
-void MorphEngine::MeshMorpher::Init()
+void MorphEngine::MeshMorpher::Fill()
 {
-	/*
 	InitFaceNormals();
-	fOctree->Fill(mesh);
-	MessageBox(0,"FaceOctree filled","Info",MB_OK);
-	octree->Fill(mesh, &avgNormals, fOctree);
-	MessageBox(0,"ADFOctree filled","Info",MB_OK);
+	BuildProxies();
+	fOctree->Fill(mesh, halfFaces.empty() ? NULL : &halfFaces);
+	forest->Fill(mesh, &avgNormals, fOctree);
 	bInit = true;
-	*/
+}
+
+void MorphEngine::MeshMorpher::InitAndPolygonize(Mesh *&result, bool bKeepOctree)
+{
+	InitFaceNormals();
+	BuildProxies();
+	fOctree->Fill(mesh, halfFaces.empty() ? NULL : &halfFaces);
+	forest->FillAndPolygonize(mesh, &avgNormals, fOctree, result, bKeepOctree);
+	bInit = bKeepOctree;
+	int numVerts = result->getNumVerts();
+	for (int i=0;i<numVerts;++i)
+		result->verts[i] = tm*result->verts[i];
 }
 
 #ifdef DISPLAY_MORPH_ENGINE
 void MorphEngine::MeshMorpher::Display(GraphicsWindow *gw) const{ 
 	//if (fOctree) fOctree->Display(gw);
-	if (octree) octree->Display(gw);
+	if (forest) forest->Display(gw);
 }
 #endif //DISPLAY_MORPH_ENGINE
 
+void MorphEngine::MeshMorpher::BuildProxies()
+{
+	FreeProxies();
+	float error = proxy_error;
+	for (int level=0; level<ADF_PROXY_LEVELS && error>0.f; ++level, error*=0.5f){
+		// a vertex moves at most by the diagonal of its cell
+		Proxy proxy;
+		proxy.mesh = GetClusteredMesh(mesh, error/sqrt(3.f), proxy.error);
+		if (!proxy.mesh)
+			continue; // a part of the mesh vanishes, a finer proxy may keep it
+		if (2*proxy.mesh->getNumFaces()>numFaces){
+			// not simple enough to be worth it, and the next ones would be even bigger
+			delete proxy.mesh;
+			break;
+		}
+		proxy.avgNormals.verticeNormal = NULL;
+		proxy.avgNormals.faceNormal = NULL;
+		ComputeAveragedNormals(proxy.mesh, proxy.avgNormals);
+		proxy.fOctree = new FaceOctree(bbox, max_depth, min_faces);
+		proxy.fOctree->Fill(proxy.mesh);
+		proxies.push_back(proxy);
+	}
+
+	std::vector<ADFProxy> adfProxies;
+	for (std::vector<Proxy>::const_iterator it=proxies.begin(); it!=proxies.end(); ++it)
+		adfProxies.push_back(ADFProxy(it->mesh, &it->avgNormals, it->fOctree, it->error));
+	forest->SetProxies(adfProxies);
+}
+
+void MorphEngine::MeshMorpher::FreeProxies()
+{
+	for (std::vector<Proxy>::iterator it=proxies.begin(); it!=proxies.end(); ++it){
+		delete it->mesh;
+		delete it->fOctree;
+		delete [] it->avgNormals.verticeNormal;
+		delete [] it->avgNormals.faceNormal;
+	}
+	proxies.clear();
+	if (forest)
+		forest->SetProxies(std::vector<ADFProxy>());
+}
+
+namespace{
+	// Get the representative of the connected part of a vertex
+	inline int FindPart(std::vector<int> &parts, int i)
+	{
+		while (parts[i]!=i){
+			parts[i] = parts[parts[i]];
+			i = parts[i];
+		}
+		return i;
+	}
+
+	// Get the distance from a point to a face, a degenerate face is measured at its corners (an upper bound)
+	inline float GetFaceDistance(const Point3 &p, const Point3 &a, const Point3 &b, const Point3 &c)
+	{
+		Point3 normal = (b-a)^(c-a);
+		float length = normal.Length();
+		if (length<=0.f)
+			return min((p-a).Length(), min((p-b).Length(), (p-c).Length()));
+		ENormalType type;
+		return (p-GetClosestDistance(p, a, b, c, normal/length, type)).Length();
+	}
+}
+
+Mesh *MorphEngine::MeshMorpher::GetClusteredMesh(const Mesh *m, float cellSize, float &error)
+{
+	int nbVerts = m->getNumVerts();
+	int nbFaces = m->getNumFaces();
+	Point3 minBox = nbVerts ? m->verts[0] : Point3(0,0,0);
+	for (int i=1;i<nbVerts;++i){
+		minBox.x = min(minBox.x, m->verts[i].x);	minBox.y = min(minBox.y, m->verts[i].y);	minBox.z = min(minBox.z, m->verts[i].z);
+	}
+
+	// the vertices of a cell are merged at their average position
+	std::map<LatticePoint, int> clusters;
+	std::vector<Point3> positions;
+	std::vector<int> counts;
+	std::vector<int> remap(nbVerts);
+	for (int i=0;i<nbVerts;++i){
+		Point3 coord((m->verts[i]-minBox)/cellSize);
+		LatticePoint lp((int)floor(coord.x), (int)floor(coord.y), (int)floor(coord.z));
+		std::map<LatticePoint, int>::iterator it = clusters.find(lp);
+		int index;
+		if (it==clusters.end()){
+			index = (int)positions.size();
+			clusters[lp] = index;
+			positions.push_back(Point3(0,0,0));
+			counts.push_back(0);
+		}
+		else
+			index = it->second;
+		positions[index] += m->verts[i];
+		++counts[index];
+		remap[i] = index;
+	}
+	for (size_t i=0;i<positions.size();++i)
+		positions[i] /= (float)counts[i];
+	error = 0.f;
+	for (int i=0;i<nbVerts;++i)
+		error = max(error, (m->verts[i]-positions[remap[i]]).Length());
+
+	// the faces collapsed by the merge disappear
+	std::vector<int> faces;
+	std::vector<int> dropped;
+	for (int i=0;i<nbFaces;++i){
+		int a = remap[m->faces[i].getVert(0)];
+		int b = remap[m->faces[i].getVert(1)];
+		int c = remap[m->faces[i].getVert(2)];
+		if (a!=b && b!=c && a!=c){
+			faces.push_back(a);	faces.push_back(b);	faces.push_back(c);
+		}
+		else
+			dropped.push_back(i);
+	}
+
+	// a connected part of the mesh whose faces all collapse vanishes: the proxy would miss a whole surface
+	std::vector<int> parts(nbVerts);
+	for (int i=0;i<nbVerts;++i)
+		parts[i] = i;
+	for (int i=0;i<nbFaces;++i){
+		int a = FindPart(parts, m->faces[i].getVert(0));
+		parts[FindPart(parts, m->faces[i].getVert(1))] = a;
+		parts[FindPart(parts, m->faces[i].getVert(2))] = a;
+	}
+	std::vector<bool> bKeptPart(nbVerts, false);
+	for (int i=0, k=0;i<nbFaces;++i){
+		if (k<(int)dropped.size() && dropped[k]==i)
+			++k;
+		else
+			bKeptPart[FindPart(parts, m->faces[i].getVert(0))] = true;
+	}
+	for (std::vector<int>::const_iterator it=dropped.begin(); it!=dropped.end(); ++it){
+		if (!bKeptPart[FindPart(parts, m->faces[*it].getVert(0))])
+			return NULL;
+	}
+
+	// the error is two-sided: the kept faces move by the largest move of their vertices, and a dropped face is
+	// measured at its center against the kept faces around its clusters. The distance to the proxy grows at most
+	// as fast as the point moves, so adding the largest distance from the center to a corner bounds it over the
+	// whole face (the closest face of the proxy may be another one, it only makes the bound larger)
+	int nbProxyFaces = (int)faces.size()/3;
+	std::vector<std::vector<int> > clusterFaces(positions.size());
+	for (int i=0;i<nbProxyFaces;++i){
+		for (int j=0;j<3;++j)
+			clusterFaces[faces[3*i+j]].push_back(i);
+	}
+	std::vector<int> candidates;
+	for (std::vector<int>::const_iterator it=dropped.begin(); it!=dropped.end(); ++it){
+		Point3 points[4];
+		candidates.clear();
+		for (int j=0;j<3;++j){
+			int v = m->faces[*it].getVert(j);
+			points[j] = m->verts[v];
+			candidates.insert(candidates.end(), clusterFaces[remap[v]].begin(), clusterFaces[remap[v]].end());
+		}
+		points[3] = (points[0]+points[1]+points[2])/3.f;
+		// the clusters of the face only hold dropped faces, look in the neighbour cells, then everywhere
+		for (int j=0;j<3 && candidates.empty();++j){
+			Point3 coord((points[j]-minBox)/cellSize);
+			LatticePoint lp((int)floor(coord.x), (int)floor(coord.y), (int)floor(coord.z));
+			for (int n=0;n<27;++n){
+				std::map<LatticePoint, int>::const_iterator cluster = clusters.find(LatticePoint(lp.x+n%3-1, lp.y+(n/3)%3-1, lp.z+n/9-1));
+				if (cluster!=clusters.end())
+					candidates.insert(candidates.end(), clusterFaces[cluster->second].begin(), clusterFaces[cluster->second].end());
+			}
+		}
+		if (candidates.empty()){
+			for (int i=0;i<nbProxyFaces;++i)
+				candidates.push_back(i);
+		}
+		float radius = 0.f;
+		for (int j=0;j<3;++j)
+			radius = max(radius, (points[j]-points[3]).Length());
+		float distance = 1e30f;
+		for (std::vector<int>::const_iterator f=candidates.begin(); f!=candidates.end(); ++f){
+			const int *face = &faces[3*(*f)];
+			distance = min(distance, GetFaceDistance(points[3], positions[face[0]], positions[face[1]], positions[face[2]]));
+		}
+		error = max(error, distance+radius);
+	}
+
+	Mesh *proxy = new Mesh();
+	proxy->setNumVerts((int)positions.size());
+	proxy->setNumFaces((int)faces.size()/3);
+	for (size_t i=0;i<positions.size();++i)
+		proxy->setVert((int)i, positions[i].x, positions[i].y, positions[i].z);
+	for (size_t i=0;i<faces.size()/3;++i){
+		proxy->faces[i].setVerts(faces[3*i], faces[3*i+1], faces[3*i+2]);
+		proxy->faces[i].setEdgeVisFlags(1,1,1);
+	}
+	return proxy;
+}
+
 void MorphEngine::MeshMorpher::InitFaceNormals()
 {
+	ComputeAveragedNormals(mesh, avgNormals);
+}
+
+void MorphEngine::MeshMorpher::ComputeAveragedNormals(const Mesh *mesh, AveragedNormal &avgNormals)
+{
+	int numVertices = mesh->getNumVerts();
+	int numFaces = mesh->getNumFaces();
+
 	// compute standard, averaged, and angle weight averaged normals (per face, per edge and per vertex normals)
 	if (avgNormals.verticeNormal){
 		delete avgNormals.verticeNormal;
@@ -123,28 +676,121 @@ void MorphEngine::MeshMorpher::InitFaceNormals()
 	}
 }
 
-void MorphEngine::SetMesh1(Mesh *m, Box3 box)
+void MorphEngine::SetMesh1(Mesh *m, const Matrix3 &tm)
 {
 	if (morph1) delete morph1;
-	morph1 = new MeshMorpher(m, box, MAX_DEPTH, MIN_ERROR, MIN_FACES_FOR_SUBDIVIDE);
-	morph1->Init();
+	morph1 = new MeshMorpher(m, tm, MAX_DEPTH, refinement, regions, symmetry, MIN_FACES_FOR_SUBDIVIDE);
+	morph1->Fill();
 }
 
 //Mesh m_temp;
 
-void MorphEngine::SetMesh2(Mesh *m, Box3 box)
+void MorphEngine::SetMesh2(Mesh *m, const Matrix3 &tm)
 {
 	if (morph2) delete morph2;
-	morph2 = new MeshMorpher(m, box, MAX_DEPTH, MIN_ERROR, MIN_FACES_FOR_SUBDIVIDE);
-	morph2->Init();
+	morph2 = new MeshMorpher(m, tm, MAX_DEPTH, refinement, regions, symmetry, MIN_FACES_FOR_SUBDIVIDE);
+	morph2->Fill();
 //	m_temp.CopyBasics(*m);
 }
 
+void MorphEngine::UpdateMesh1(Mesh *m, const Matrix3 &tm)
+{
+	if (morph1 && !morph1->HasMoved(m)){
+		if (morph1->GetOperandTM()==tm)
+			return;
+		// the octrees don't depend on the transform, only the polygonized meshes have to be placed again
+		if (!morph1->SetTM(tm))
+			SetMesh1(m, tm);
+	}
+	else if (!morph1 || !morph1->SetTM(tm) || !morph1->Update(m))
+		SetMesh1(m, tm);
+	ClearMeshesCache();
+}
+
+void MorphEngine::UpdateMesh2(Mesh *m, const Matrix3 &tm)
+{
+	if (morph2 && !morph2->HasMoved(m)){
+		if (morph2->GetOperandTM()==tm)
+			return;
+		// the octrees don't depend on the transform, only the polygonized meshes have to be placed again
+		if (!morph2->SetTM(tm))
+			SetMesh2(m, tm);
+	}
+	else if (!morph2 || !morph2->SetTM(tm) || !morph2->Update(m))
+		SetMesh2(m, tm);
+	ClearMeshesCache();
+}
+
+bool MorphEngine::GetRegionFromWeights(const Mesh &mesh, const float *weights, float threshold, int max_depth, float relative_error, RegionOfInterest &region)
+{
+	bool bFound = false;
+	Point3 rmin, rmax;
+	int numVerts = mesh.getNumVerts();
+	for (int i=0;i<numVerts;++i){
+		if (weights[i]<=threshold)
+			continue;
+		const Point3 &p = mesh.verts[i];
+		if (!bFound){
+			rmin = rmax = p;
+			bFound = true;
+		}
+		else{
+			rmin.x = min(rmin.x, p.x);	rmin.y = min(rmin.y, p.y);	rmin.z = min(rmin.z, p.z);
+			rmax.x = max(rmax.x, p.x);	rmax.y = max(rmax.y, p.y);	rmax.z = max(rmax.z, p.z);
+		}
+	}
+	if (bFound)
+		region = RegionOfInterest(Box3(rmin, rmax), max_depth, relative_error);
+	return bFound;
+}
+
+bool MorphEngine::DetectSymmetry(const Mesh &mesh, float tolerance, int &axis, float &plane)
+{
+	int numVerts = mesh.getNumVerts();
+	if (!numVerts || tolerance<=0.f)
+		return false;
+
+	// hash the vertices on a grid of cells of the size of the tolerance
+	Box3 meshBox = const_cast<Mesh &>(mesh).getBoundingBox();
+	Point3 minBox = meshBox.Min();
+	std::map<LatticePoint, std::vector<int> > grid;
+	for (int i=0;i<numVerts;++i){
+		Point3 coord((mesh.verts[i]-minBox)/tolerance);
+		grid[LatticePoint((int)floor(coord.x), (int)floor(coord.y), (int)floor(coord.z))].push_back(i);
+	}
+
+	float tolerance2 = tolerance*tolerance;
+	for (axis=0;axis<3;++axis){
+		plane = meshBox.Center()[axis];
+		bool bSymmetric = true;
+		for (int i=0;i<numVerts && bSymmetric;++i){
+			Point3 r(mesh.verts[i]);
+			r[axis] = 2.f*plane-r[axis];
+			Point3 coord((r-minBox)/tolerance);
+			LatticePoint lp((int)floor(coord.x), (int)floor(coord.y), (int)floor(coord.z));
+			// look for a vertex close to the reflection in the 27 cells around it
+			bool bFound = false;
+			for (int c=0;c<27 && !bFound;++c){
+				std::map<LatticePoint, std::vector<int> >::const_iterator it = grid.find(LatticePoint(lp.x+c%3-1, lp.y+(c/3)%3-1, lp.z+c/9-1));
+				if (it==grid.end())
+					continue;
+				for (std::vector<int>::const_iterator v=it->second.begin(); v!=it->second.end() && !bFound; ++v)
+					bFound = (mesh.verts[*v]-r).LengthSquared()<=tolerance2;
+			}
+			bSymmetric = bFound;
+		}
+		if (bSymmetric)
+			return true;
+	}
+	axis = -1;
+	return false;
+}
+
 void MorphEngine::FindMeshInCache(Mesh *&m, float coeff_morphing_) const
 {
 	std::vector<InterpolatedMesh *>::const_iterator it;
 	for (it = meshesCache.begin(); it != meshesCache.end(); ++it){
-		if ((*it)->interpCoeff == coeff_morphing_){
+		if ((*it)->interpCoeff == coeff_morphing_ && (*it)->lod == lod){
 			m = (*it)->mesh;
 			return;
 		}
@@ -152,13 +798,368 @@ void MorphEngine::FindMeshInCache(Mesh *&m, float coeff_morphing_) const
 	m = NULL;
 }
 
+void MorphEngine::ClearMeshesCache()
+{
+	for (std::vector<InterpolatedMesh *>::iterator it=meshesCache.begin();it!=meshesCache.end();++it)
+		delete (*it);
+	meshesCache.clear();
+	blendSamples.clear();
+	coherentCells.clear();
+	coherentVertices.clear();
+	if (coherentMesh) delete coherentMesh;
+	coherentMesh = NULL;
+}
+
 void MorphEngine::ComputeInterpolatedMesh(Mesh *&m, float coeff_morphing_)
 {
-	std::vector<SplPoint3> listOfVertices;
-	std::vector<SplFace> listOfFaces;
-	
-	//Marching Cubes Algorithm
-	int todo;
+	m = NULL;
+	if (bContinuation)
+		ComputeContinuationMesh(m, coeff_morphing_);
+	else
+		ComputeInterpolatedMeshes(&m, &coeff_morphing_, 1);
+}
+
+void MorphEngine::ComputeContinuationMesh(Mesh *&m, float coeff_morphing)
+{
+	Point3 minBox, step;
+	GetBlendGrid(minBox, step);
+	int nbCells = 1<<GetBlendDepth();
+
+	// the seeds are vertices of both operands, pulled onto the surface of the blend by a few Newton steps
+	std::vector<Point3> seeds;
+	const MeshMorpher *morphs[2] = {morph1, morph2};
+	for (int k=0;k<2;++k){
+		const Mesh *mesh = morphs[k]->GetMesh();
+		const Matrix3 &tm = morphs[k]->GetTM();
+		int nbVerts = mesh->getNumVerts();
+		int stride = max(1, nbVerts/MC_CONTINUATION_SEEDS);
+		for (int i=0;i<nbVerts;i+=stride)
+			seeds.push_back(tm*mesh->verts[i]);
+	}
+	int nbSeeds = (int)seeds.size();
+	std::vector<float> distances1(nbSeeds), distances2(nbSeeds);
+	std::vector<Point3> gradients1(nbSeeds), gradients2(nbSeeds);
+	for (int n=0;n<4 && nbSeeds;++n){
+		morph1->GetDistances(&seeds[0], nbSeeds, &distances1[0], &gradients1[0]);
+		morph2->GetDistances(&seeds[0], nbSeeds, &distances2[0], &gradients2[0]);
+		for (int i=0;i<nbSeeds;++i){
+			float f = (1.f-coeff_morphing)*distances1[i] + coeff_morphing*distances2[i];
+			Point3 grad = (1.f-coeff_morphing)*gradients1[i] + coeff_morphing*gradients2[i];
+			float len2 = DotProd(grad, grad);
+			if (len2>1e-12f)
+				seeds[i] -= grad*(f/len2);
+		}
+	}
+
+	// march from the cells of the seeds to their neighbours through the faces crossed by the surface, only the
+	// cells next to the surface are visited. The cells are processed front by front, so that the missing
+	// distances at the corners of a front are queried at once.
+	std::set<LatticePoint> visited;
+	std::map<LatticePoint, BlendSample> samples;
+	// cells of the current front, and whether they are seeds (a seed not crossed still looks at its neighbours)
+	std::vector<LatticePoint> front;
+	std::vector<bool> bSeeds;
+	for (int i=0;i<nbSeeds;++i){
+		Point3 coord = (seeds[i]-minBox)/step;
+		LatticePoint lp(max(0, min(nbCells-1, (int)floor(coord.x))),
+						max(0, min(nbCells-1, (int)floor(coord.y))),
+						max(0, min(nbCells-1, (int)floor(coord.z))));
+		if (visited.insert(lp).second){
+			front.push_back(lp);
+			bSeeds.push_back(true);
+		}
+	}
+
+	MarchingCube MC;
+	Poly plist;
+	Poly *plist_ptr = &plist;
+	while (!front.empty()){
+		SampleBlendCorners(front, 1, minBox, step, samples);
+		std::vector<LatticePoint> next;
+		std::vector<bool> bNextSeeds;
+		for (size_t k=0;k<front.size();++k){
+			float d1[8], diff[8], blended[8];
+			GetCornerSamples(samples, front[k], 1, d1, diff);
+			BlendCorners(d1, diff, coeff_morphing, blended);
+			int indexInMap = MarchingCube::GetIndexInMap(blended);
+			bool bCrossed = (indexInMap!=0 && indexInMap!=255);
+			if (bCrossed){
+				Point3 cellMin = minBox + Point3((float)front[k].x*step.x, (float)front[k].y*step.y, (float)front[k].z*step.z);
+				MC.ComputeMCInLeaf(blended, cellMin, cellMin+step, plist_ptr);
+			}
+			else if (!bSeeds[k])
+				continue;
+			for (int face=0;face<6;++face){
+				if (bCrossed && !IsFaceCrossed(blended, face))
+					continue;
+				LatticePoint lp(front[k]);
+				int &coord = (face<2) ? lp.x : ((face<4) ? lp.y : lp.z);
+				coord += (face&1) ? 1 : -1;
+				if (coord<0 || coord>=nbCells)
+					continue;
+				if (visited.insert(lp).second){
+					next.push_back(lp);
+					bNextSeeds.push_back(false);
+				}
+			}
+		}
+		front.swap(next);
+		bSeeds.swap(bNextSeeds);
+	}
+	MC.GetMeshFromPolys(plist, plist_ptr, m);
+}
+
+void MorphEngine::GetBlendGrid(Point3 &minBox, Point3 &step) const
+{
+	Box3 box = morph1->GetRealBox();
+	box += morph2->GetRealBox();
+	minBox = box.Min();
+	step = box.Width()/(float)(1<<GetBlendDepth());
+}
+
+void MorphEngine::SampleBlendCorners(const std::vector<LatticePoint> &cells, int size, const Point3 &minBox, const Point3 &step,
+									 std::map<LatticePoint, BlendSample> &samples) const
+{
+	std::vector<LatticePoint> missing;
+	std::vector<Point3> points;
+	for (size_t k=0;k<cells.size();++k){
+		for (int i=0;i<8;++i){
+			LatticePoint lp(cells[k].x+((i&1) ? size : 0), cells[k].y+((i&2) ? size : 0), cells[k].z+((i&4) ? size : 0));
+			if (samples.insert(std::make_pair(lp, BlendSample())).second){
+				missing.push_back(lp);
+				points.push_back(minBox + Point3((float)lp.x*step.x, (float)lp.y*step.y, (float)lp.z*step.z));
+			}
+		}
+	}
+	if (points.empty())
+		return;
+	std::vector<float> distances1(points.size());
+	std::vector<float> distances2(points.size());
+	morph1->GetDistances(&points[0], (int)points.size(), &distances1[0]);
+	morph2->GetDistances(&points[0], (int)points.size(), &distances2[0]);
+	for (size_t k=0;k<missing.size();++k){
+		BlendSample &s = samples[missing[k]];
+		s.d1 = distances1[k];
+		s.d2 = distances2[k];
+	}
+}
+
+void MorphEngine::GetBlendLeaves(const float *coeffs, int nbCoeffs, std::map<LatticePoint, BlendSample> &samples, std::vector<LatticePoint> &leaves) const
+{
+	// the grid is walked as an octree: a cell is only subdivided if the surface of one of the blends can cross it.
+	// The cells are processed level by level, so that the corners of a level missing from 'samples' are queried at once.
+	Point3 minBox, step;
+	GetBlendGrid(minBox, step);
+	int nbCells = 1<<GetBlendDepth();
+
+	// a blend changes at most by (|1-t|+|t|) times the length of a move, like the distances it blends
+	float maxSlope = 0.f;
+	for (int j=0;j<nbCoeffs;++j)
+		maxSlope = max(maxSlope, abs(1.f-coeffs[j])+abs(coeffs[j]));
+
+	leaves.clear();
+	// min corners of the cells of the current level, in number of cells of the grid
+	std::vector<LatticePoint> cells(1, LatticePoint(0, 0, 0));
+	for (int level=0;level<=GetBlendDepth() && !cells.empty();++level){
+		int size = nbCells>>level;
+		SampleBlendCorners(cells, size, minBox, step, samples);
+		if (level==GetBlendDepth()){
+			leaves.swap(cells);
+			break;
+		}
+
+		float reach = maxSlope*(step*(float)size).Length();
+		int half = size>>1;
+		std::vector<LatticePoint> childs;
+		for (size_t k=0;k<cells.size();++k){
+			float d1[8], diff[8], blended[8];
+			GetCornerSamples(samples, cells[k], size, d1, diff);
+			// the bounds of the fields over the cell, from their octrees, are only gathered for the cells the
+			// corners alone can't cull, they are tighter than the reach away from the surfaces
+			bool bBounds = false;
+			float min1, max1, min2, max2;
+			for (int j=0;j<nbCoeffs;++j){
+				if (BlendCorners(d1, diff, coeffs[j], blended)>reach)
+					continue;
+				if (!bBounds){
+					Point3 cellMin = minBox + Point3((float)cells[k].x*step.x, (float)cells[k].y*step.y, (float)cells[k].z*step.z);
+					Box3 cellBox(cellMin, cellMin+step*(float)size);
+					morph1->GetDistanceBounds(cellBox, min1, max1);
+					morph2->GetDistanceBounds(cellBox, min2, max2);
+					bBounds = true;
+				}
+				float t = coeffs[j];
+				float lo = (1.f-t)*(t<=1.f ? min1 : max1) + t*(t>=0.f ? min2 : max2);
+				float hi = (1.f-t)*(t<=1.f ? max1 : min1) + t*(t>=0.f ? max2 : min2);
+				if (lo<0.f && hi>=0.f){
+					for (int i=0;i<8;++i)
+						childs.push_back(LatticePoint(cells[k].x+((i&1) ? half : 0), cells[k].y+((i&2) ? half : 0), cells[k].z+((i&4) ? half : 0)));
+					break;
+				}
+			}
+		}
+		cells.swap(childs);
+	}
+}
+
+void MorphEngine::ComputeInterpolatedMeshes(Mesh **meshes, const float *coeffs, int nbCoeffs)
+{
+	// the blends are polygonized on a grid of 2^GetBlendDepth() cells covering both operands
+	std::map<LatticePoint, BlendSample> samples;
+	std::vector<LatticePoint> leaves;
+	GetBlendLeaves(coeffs, nbCoeffs, samples, leaves);
+	Point3 minBox, step;
+	GetBlendGrid(minBox, step);
+
+	MarchingCube MC;
+	std::vector<Poly> plists(nbCoeffs);
+	std::vector<Poly *> plist_ptrs(nbCoeffs);
+	for (int j=0;j<nbCoeffs;++j)
+		plist_ptrs[j] = &plists[j];
+
+	for (size_t k=0;k<leaves.size();++k){
+		float d1[8], diff[8], blended[8];
+		GetCornerSamples(samples, leaves[k], 1, d1, diff);
+		Point3 cellMin = minBox + Point3((float)leaves[k].x*step.x, (float)leaves[k].y*step.y, (float)leaves[k].z*step.z);
+		for (int j=0;j<nbCoeffs;++j){
+			BlendCorners(d1, diff, coeffs[j], blended);
+			MC.ComputeMCInLeaf(blended, cellMin, cellMin+step, plist_ptrs[j]);
+		}
+	}
+
+	for (int j=0;j<nbCoeffs;++j)
+		MC.GetMeshFromPolys(plists[j], plist_ptrs[j], meshes[j]);
+}
+
+void MorphEngine::ComputeKeyframedMeshes(Mesh **meshes, const float *coeffs, int nbCoeffs)
+{
+	std::map<LatticePoint, BlendSample> samples;
+	std::vector<LatticePoint> leaves;
+	GetBlendLeaves(coeffs, nbCoeffs, samples, leaves);
+	Point3 minBox, step;
+	GetBlendGrid(minBox, step);
+
+	// distances at the corners of the cells reached by one of the blends
+	std::vector<BlendSample> corners;
+	std::set<LatticePoint> seen;
+	for (size_t k=0;k<leaves.size();++k){
+		for (int i=0;i<8;++i){
+			LatticePoint lp(leaves[k].x+(i&1), leaves[k].y+((i>>1)&1), leaves[k].z+((i>>2)&1));
+			if (seen.insert(lp).second)
+				corners.push_back(samples.find(lp)->second);
+		}
+	}
+
+	std::vector<std::pair<float, int> > sorted(nbCoeffs);
+	for (int j=0;j<nbCoeffs;++j)
+		sorted[j] = std::make_pair(coeffs[j], j);
+	std::sort(sorted.begin(), sorted.end());
+	std::vector<bool> bChange(nbCoeffs, false);
+	FindTopologyChanges(corners, sorted, 0, nbCoeffs-1, bChange);
+
+	// the triangles are only extracted at the first coefficient of each run sharing the same topology
+	int start = 0;
+	for (int j=0;j<nbCoeffs;++j){
+		if (j<nbCoeffs-1 && !bChange[j])
+			continue;
+		float key = sorted[start].first;
+		std::vector<GridEdge> triangles;
+		for (size_t k=0;k<leaves.size();++k){
+			float d1[8], diff[8], blended[8];
+			GetCornerSamples(samples, leaves[k], 1, d1, diff);
+			BlendCorners(d1, diff, key, blended);
+			int indexInMap = MarchingCube::GetIndexInMap(blended);
+			if (indexInMap!=0 && indexInMap!=255)
+				AddCellTriangles(leaves[k], indexInMap, triangles);
+		}
+		std::map<GridEdge, int> vertices;
+		for (size_t i=0;i<triangles.size();++i)
+			vertices[triangles[i]] = 0;
+		int nbOfPoints = 0;
+		for (std::map<GridEdge, int>::iterator it=vertices.begin();it!=vertices.end();++it)
+			it->second = nbOfPoints++;
+		for (int i=start;i<=j;++i)
+			meshes[sorted[i].second] = GetEdgeMesh(triangles, vertices, samples, sorted[i].first, minBox, step);
+		start = j+1;
+	}
+}
+
+bool MorphEngine::GetCoherentMesh(Mesh *&m, float coeff_morphing)
+{
+	// the state of the previous call is on the grid of another level of detail
+	if (coherentLOD!=lod){
+		blendSamples.clear();
+		coherentCells.clear();
+		coherentVertices.clear();
+		if (coherentMesh) delete coherentMesh;
+		coherentMesh = NULL;
+		coherentLOD = lod;
+	}
+	// the distances at the vertices of the grid are kept from the previous calls, only the cells reached
+	// for the first time are sampled
+	std::vector<LatticePoint> leaves;
+	GetBlendLeaves(&coeff_morphing, 1, blendSamples, leaves);
+	Point3 minBox, step;
+	GetBlendGrid(minBox, step);
+
+	// the cells crossed by the surface keep their triangles if their case is the same as in the previous mesh
+	bool bTopologyChanged = (coherentMesh==NULL);
+	std::map<LatticePoint, CoherentCell> cells;
+	for (size_t k=0;k<leaves.size();++k){
+		float d1[8], diff[8], blended[8];
+		GetCornerSamples(blendSamples, leaves[k], 1, d1, diff);
+		BlendCorners(d1, diff, coeff_morphing, blended);
+		int indexInMap = MarchingCube::GetIndexInMap(blended);
+		if (indexInMap==0 || indexInMap==255)
+			continue;
+		CoherentCell &cell = cells[leaves[k]];
+		cell.indexInMap = indexInMap;
+		std::map<LatticePoint, CoherentCell>::iterator it = coherentCells.find(leaves[k]);
+		if (it!=coherentCells.end() && it->second.indexInMap==indexInMap){
+			cell.triangles.swap(it->second.triangles);
+			continue;
+		}
+		bTopologyChanged = true;
+		AddCellTriangles(leaves[k], indexInMap, cell.triangles);
+	}
+	// all the remaining cells were matched, so the previous mesh had more cells if the counts differ
+	if (cells.size()!=coherentCells.size())
+		bTopologyChanged = true;
+	coherentCells.swap(cells);
+
+	if (!bTopologyChanged){
+		// same faces, only the vertices slide along their edges
+		for (std::map<GridEdge, int>::const_iterator it=coherentVertices.begin();it!=coherentVertices.end();++it)
+			coherentMesh->setVert(it->second, GetEdgeVertex(blendSamples, it->first, coeff_morphing, minBox, step));
+		coherentMesh->InvalidateGeomCache();
+		m = coherentMesh;
+		return true;
+	}
+
+	// number the vertices again: the ones still used keep their order, the new ones are added at the end
+	std::vector<GridEdge> triangles;
+	for (std::map<LatticePoint, CoherentCell>::const_iterator it=coherentCells.begin();it!=coherentCells.end();++it)
+		triangles.insert(triangles.end(), it->second.triangles.begin(), it->second.triangles.end());
+	std::map<GridEdge, int> vertices;
+	for (size_t i=0;i<triangles.size();++i)
+		vertices[triangles[i]] = -1;
+	std::vector<std::pair<int, GridEdge> > kept;
+	for (std::map<GridEdge, int>::const_iterator it=coherentVertices.begin();it!=coherentVertices.end();++it)
+		if (vertices.find(it->first)!=vertices.end())
+			kept.push_back(std::make_pair(it->second, it->first));
+	std::sort(kept.begin(), kept.end());
+	int nbOfPoints = 0;
+	for (size_t i=0;i<kept.size();++i)
+		vertices[kept[i].second] = nbOfPoints++;
+	for (std::map<GridEdge, int>::iterator it=vertices.begin();it!=vertices.end();++it)
+		if (it->second==-1)
+			it->second = nbOfPoints++;
+	coherentVertices.swap(vertices);
+
+	if (coherentMesh) delete coherentMesh;
+	coherentMesh = GetEdgeMesh(triangles, coherentVertices, blendSamples, coeff_morphing, minBox, step);
+	m = coherentMesh;
+	return true;
 }
 
 /*
@@ -289,11 +1290,22 @@ void MorphEngine::ComputeMesh(Mesh *&m, ADFOctree *octree)
 }
 */
 
-void MorphEngine::ComputeMesh(Mesh *&m, ADFOctree *octree)
+void MorphEngine::ComputeMesh(Mesh *&m, const MeshMorpher *morph)
 {
 	//Marching Cubes Algorithm + Optimization of the faces
 	MarchingCube MC;
-	MC.GetMeshFromOctree(&octree->root, octree->bbox, m);
+	MC.SetLOD(lod);
+	if (bContouring)
+		MC.GetDualContourFromForest(morph->GetADFForestPtr(), m);
+	else if (bDual)
+		MC.GetDualMeshFromForest(morph->GetADFForestPtr(), m);
+	else
+		MC.GetMeshFromForest(morph->GetADFForestPtr(), m);
+	// the octrees are in the local space of the operand
+	const Matrix3 &tm = morph->GetTM();
+	int numVerts = m->getNumVerts();
+	for (int i=0;i<numVerts;++i)
+		m->verts[i] = tm*m->verts[i];
 }
 
 
@@ -317,8 +1329,18 @@ void MorphEngine::Display(int index, GraphicsWindow *gw) const
 }
 #endif //DISPLAY_MORPH_ENGINE
 
-bool MorphEngine::GetResultMesh(Mesh *&m, float coeff_morphing)
+bool MorphEngine::GetResultMesh(Mesh *&m, float coeff_morphing, std::vector<Point3> *velocities, int lod_)
 {
+	lod = max(0, lod_);
+	if (velocities)
+		velocities->clear();
+	if (morphingMode == EMT_Morphing){
+		if (!GetMorphingMesh(m, coeff_morphing))
+			return false;
+		if (velocities && morph1 && morph2)
+			ComputeVelocities(m, coeff_morphing, *velocities);
+		return true;
+	}
 	if (morphingMode == EMT_None)
 		return false;
 	else if (morphingMode == EMT_RigidOnly)
@@ -327,17 +1349,115 @@ bool MorphEngine::GetResultMesh(Mesh *&m, float coeff_morphing)
 		return GetTransformedMesh(m, coeff_morphing, false, true);
 	else if (morphingMode == EMT_RigidElastic)
 		return GetTransformedMesh(m, coeff_morphing, true, true);
-	else if (morphingMode == EMT_Morphing)
-		return GetMorphingMesh(m, coeff_morphing);
 	return false;
 }
 
+void MorphEngine::ComputeVelocities(const Mesh *m, float coeff_morphing, std::vector<Point3> &velocities) const
+{
+	int nbVerts = m->getNumVerts();
+	velocities.assign(nbVerts, Point3(0.f, 0.f, 0.f));
+	if (nbVerts==0)
+		return;
+	std::vector<float> distances1(nbVerts), distances2(nbVerts);
+	std::vector<Point3> gradients1(nbVerts), gradients2(nbVerts);
+	morph1->GetDistances(m->verts, nbVerts, &distances1[0], &gradients1[0]);
+	morph2->GetDistances(m->verts, nbVerts, &distances2[0], &gradients2[0]);
+	for (int i=0;i<nbVerts;++i){
+		Point3 grad = (1.f-coeff_morphing)*gradients1[i] + coeff_morphing*gradients2[i];
+		float len2 = DotProd(grad, grad);
+		// flat blend (the surface appears or vanishes there): no direction to move along
+		if (len2>1e-12f)
+			velocities[i] = grad*(-(distances2[i]-distances1[i])/len2);
+	}
+}
+
+Mesh *MorphEngine::Remesh(Mesh *m) const
+{
+	MeshMorpher morph(m, Matrix3(1), MAX_DEPTH, refinement, regions, symmetry, MIN_FACES_FOR_SUBDIVIDE);
+	Mesh *result = NULL;
+	if (!bDual && !bContouring){
+		morph.InitAndPolygonize(result, false);
+		return result;
+	}
+	// the dual cells and the edges of the dual contouring join leaves of several branches: the whole octree
+	// (and the Hermite data of the FaceOctree) is needed
+	morph.Fill();
+	MarchingCube MC;
+	if (bContouring)
+		MC.GetDualContourFromForest(morph.GetADFForestPtr(), result);
+	else
+		MC.GetDualMeshFromForest(morph.GetADFForestPtr(), result);
+	const Matrix3 &tm = morph.GetTM();
+	int numVerts = result->getNumVerts();
+	for (int i=0;i<numVerts;++i)
+		result->verts[i] = tm*result->verts[i];
+	return result;
+}
+
+bool MorphEngine::GetResultMeshes(Mesh **meshes, const float *coeffs, int nbCoeffs, int lod_)
+{
+	lod = max(0, lod_);
+	bool res = true;
+	std::vector<float> missing;
+	std::vector<int> indices;
+	for (int i=0;i<nbCoeffs;++i){
+		meshes[i] = NULL;
+		if (morphingMode!=EMT_Morphing || coeffs[i]==0.f || coeffs[i]==1.f || !morph1 || !morph2){
+			if (!GetResultMesh(meshes[i], coeffs[i], NULL, lod))
+				res = false;
+			continue;
+		}
+		FindMeshInCache(meshes[i], coeffs[i]);
+		if (!meshes[i]){
+			missing.push_back(coeffs[i]);
+			indices.push_back(i);
+		}
+	}
+	if (missing.empty())
+		return res;
+
+	std::vector<Mesh *> computed(missing.size(), (Mesh *)NULL);
+	if (bCoherent)
+		ComputeKeyframedMeshes(&computed[0], &missing[0], (int)missing.size());
+	else
+		ComputeInterpolatedMeshes(&computed[0], &missing[0], (int)missing.size());
+	for (size_t k=0;k<missing.size();++k){
+		meshes[indices[k]] = computed[k];
+		if (computed[k])
+			meshesCache.push_back(new InterpolatedMesh(computed[k], missing[k], lod));
+		else
+			res = false;
+	}
+	return res;
+}
+
+int MorphEngine::GetLODFromScreenSize(float pixels) const
+{
+	// the ADF is a forest of roots, each with its own levels: a depth has as many times more cells along the
+	// largest side as there are roots along it (the operand with the fewest roots decides, its cells are larger)
+	int nbRoots = 0;
+	const MeshMorpher *morphs[2] = {morph1, morph2};
+	for (int i=0;i<2;++i){
+		if (!morphs[i])
+			continue;
+		const ADFForest *forest = morphs[i]->GetADFForestPtr();
+		int k = max(forest->GetNumRoots(0), max(forest->GetNumRoots(1), forest->GetNumRoots(2)));
+		nbRoots = nbRoots ? min(nbRoots, k) : k;
+	}
+	nbRoots = max(nbRoots, 1);
+	// coarsest depth giving small enough cells, the finest levels beyond it are skipped
+	int depth = MC_MIN_LOD_DEPTH;
+	while (depth<MAX_DEPTH && (float)(nbRoots<<depth)*MC_PIXELS_PER_CELL<pixels)
+		++depth;
+	return max(0, MAX_DEPTH-depth);
+}
+
 bool MorphEngine::GetMorphingMesh(Mesh *&m, float coeff_morphing)
 {
 	// <--temp for marching cube debug
 #ifdef DISPLAY_MORPH_ENGINE
 	if (m_temp==NULL)
-		ComputeMesh(m_temp, morph1->GetADFOctreePtr());
+		ComputeMesh(m_temp, morph1);
 	static Mesh *m_to_return = new Mesh();
 	m = m_to_return;
 	return true;
@@ -350,23 +1470,26 @@ bool MorphEngine::GetMorphingMesh(Mesh *&m, float coeff_morphing)
 	if (coeff_morphing == 0.f){
 		if (morph1){
 			// m = morph1->GetMesh(); // temp
-			ComputeMesh(m, morph1->GetADFOctreePtr()); // temp
-			meshesCache.push_back(new InterpolatedMesh(m, coeff_morphing)); // temp
+			ComputeMesh(m, morph1); // temp
+			meshesCache.push_back(new InterpolatedMesh(m, coeff_morphing, lod)); // temp
 		}
 	}
 	else if (coeff_morphing == 1.f){
 		if (morph2){
 			// m = morph2->GetMesh(); // temp
-			ComputeMesh(m, morph2->GetADFOctreePtr()); // temp
-			meshesCache.push_back(new InterpolatedMesh(m, coeff_morphing)); // temp
+			ComputeMesh(m, morph2); // temp
+			meshesCache.push_back(new InterpolatedMesh(m, coeff_morphing, lod)); // temp
 		}
 	}
 	else if (morph1 && morph2){
+		// the coherent mesh is owned by the engine and changes with each call, it isn't cached
+		if (bCoherent)
+			return GetCoherentMesh(m, coeff_morphing);
 		FindMeshInCache(m, coeff_morphing);
 		if (!m){
 			ComputeInterpolatedMesh(m, coeff_morphing);
 			if (m) 
-				meshesCache.push_back(new InterpolatedMesh(m, coeff_morphing));
+				meshesCache.push_back(new InterpolatedMesh(m, coeff_morphing, lod));
 		}
 	}
 	return (m!=NULL);
@@ -447,6 +1570,10 @@ bool MorphEngine::GetTransformedMesh(Mesh *&mesh, float coeff_morphing, bool bAp
 		return false;
 
 	mesh = new Mesh(*morph1->GetMesh());
+	// the rigid transformation is computed between the operands placed with their transforms
+	const Matrix3 &tm = morph1->GetTM();
+	for (int i=0; i<mesh->numVerts; ++i)
+		mesh->verts[i] = tm*mesh->verts[i];
 	if (coeff_morphing == 0.f)
 		return true;
 	
@@ -17,6 +17,7 @@
 	
 #include "ADFOctree.h"
 #include "WarpTransform.h"
+#include "MorphEngineDefines.h"
 
 // Morph3DEngine Class Version
 #define MORPH3D_ENG_VERSION 100
@@ -30,6 +31,16 @@ enum EMorphingType
 	EMT_Morphing
 };
 
+// Plane of symmetry of the meshes: the field is only built for the half above the plane (through the center of the mesh)
+enum ESymmetry
+{
+	ES_None = -1,
+	ES_X,
+	ES_Y,
+	ES_Z,
+	ES_Auto		// detected within ADF_SYMMETRY_TOLERANCE
+};
+
 struct Anchor
 {
 	Point3 s, t;
@@ -81,33 +92,69 @@ struct SplFace{
 	inline bool operator==(const SplFace &f){return (a==f.a && b==f.b && c==f.c);}
 };
 
+// distances of the two operands at a vertex of the grid of the in-between meshes
+struct BlendSample{
+	float d1, d2;
+	inline BlendSample():d1(0.f),d2(0.f){}
+};
+
+// edge of the grid of the in-between meshes, from a vertex of the grid along an axis (0, 1 or 2)
+struct GridEdge{
+	LatticePoint p;
+	int axis;
+	inline GridEdge(const LatticePoint &p, int axis):p(p),axis(axis){}
+	inline GridEdge():axis(0){}
+	inline bool operator<(const GridEdge &e) const{
+		if (p<e.p) return true;
+		else if (e.p<p) return false;
+		return axis<e.axis;
+	}
+};
+
 class MorphEngine{
 private:
 	class MeshMorpher{
 	// Data
 	private:
 		Mesh *mesh;
-		ADFOctree *octree;
+		ADFForest *forest;
 		FaceOctree *fOctree;
-		Box3 realBox;
+		// transform from the local space of the mesh, where the octrees are built, to the space of the morphing
+		// (the node transform of the operand), it is only applied when the octrees are queried or polygonized
+		Matrix3 tm;
+		// transform of the operand, baked into the mesh when it isn't a similarity ('tm' is the identity then)
+		Matrix3 bakedTM;
+		bool bBakedTM;
 		bool bInit;		
 		int max_depth;
-		double min_error;
 		int min_faces;
 		Box3 bbox;
+		// faces filling the FaceOctree of a symmetric mesh (the ones reaching the half above the plane)
+		std::vector<int> halfFaces;
 		AveragedNormal avgNormals;
 		int numFaces, numVertices;
+		// simplified versions of the mesh used by the ADF at the coarse levels, from the coarsest to the finest
+		struct Proxy{
+			Mesh *mesh;
+			AveragedNormal avgNormals;
+			FaceOctree *fOctree;
+			float error;
+		};
+		std::vector<Proxy> proxies;
+		float proxy_error; // error allowed to the coarsest proxy
 
 	// ctor
 	public:
-		MeshMorpher(Mesh *m, Box3 realBox, int max_depth, double min_error, int min_faces);
+		MeshMorpher(Mesh *m, const Matrix3 &tm, int max_depth, const ADFRefinement &refinement,
+					const std::vector<RegionOfInterest> &regions, ESymmetry symmetry, int min_faces);
 		~MeshMorpher(){
+			FreeProxies();
 			if (mesh) delete mesh;
-			if (octree) delete octree;
+			if (forest) delete forest;
 			if (fOctree) delete fOctree;
 			mesh = NULL;
 			fOctree = NULL;
-			octree = NULL;
+			forest = NULL;
 		}
 
 	// Member Functions
@@ -116,12 +163,45 @@ private:
 		void FillADFOctree();
 		void InitFaceNormals();
 		void InitBox(const Box3 &bbox_, int maxDepth);
+		void BuildProxies();
+		void FreeProxies();
+		static void ComputeAveragedNormals(const Mesh *m, AveragedNormal &normals);
+		// Scale factor from the local space of the mesh to the space of the morphing
+		float GetScale() const;
+		// Check if a transform only scales uniformly, the distances can then be scaled with it
+		static bool IsSimilarity(const Matrix3 &tm);
+		// Merge the vertices of a mesh falling in the same cell of a grid, 'error' bounds the distance between the
+		// mesh and the result both ways, NULL is returned if a connected part of the mesh vanishes
+		static Mesh *GetClusteredMesh(const Mesh *m, float cellSize, float &error);
 	public:
 		Mesh *GetMesh() const{return mesh;}
 		Box3 GetBBox() const{return bbox;}
-		Box3 GetRealBox() const{return realBox;}
-		ADFOctree *GetADFOctreePtr () const{return octree;}
-		void Init();
+		Box3 GetRealBox() const{
+			Box3 box = mesh->getBoundingBox();
+			return Box3(tm*box.pmin, tm*box.pmax);
+		}
+		const Matrix3 &GetTM() const{return tm;}
+		const Matrix3 &GetOperandTM() const{return bBakedTM ? bakedTM : tm;}
+		// moving the operand doesn't change its octrees, unless the transform isn't a similarity (or the previous
+		// one wasn't): false is returned then, and the morpher must be built again
+		bool SetTM(const Matrix3 &tm_);
+		// Get the signed distances to the mesh at points given in the space of the morphing (and their gradients
+		// if 'gradients' isn't NULL), the distances are measured in the space of the morphing
+		void GetDistances(const Point3 *points, int nbPoints, float *distances, Point3 *gradients=NULL) const;
+		// Get the bounds of the distances given by GetDistances over a box of the space of the morphing
+		void GetDistanceBounds(const Box3 &box, float &minDist, float &maxDist) const;
+		ADFForest *GetADFForestPtr () const{return forest;}
+		// Fill the FaceOctree and the ADF of the mesh (and of its proxies), the octrees can then be updated
+		// around the moved faces of the mesh
+		void Fill();
+		// Same as Fill, the mesh of the distance field (placed with the transform) is polygonized during the fill
+		// of the ADF. If 'bKeepOctree' is false the ADF isn't kept, and the operand can't be morphed anymore.
+		void InitAndPolygonize(Mesh *&result, bool bKeepOctree);
+		// Check if the vertices or the faces of a new version of the mesh differ from the current ones
+		bool HasMoved(const Mesh *m) const;
+		// Move the vertices of the mesh to the ones of 'm' and update the octrees around the moved faces only,
+		// returns false if it can't be done (different topology, vertices leaving the octrees, symmetric mesh...)
+		bool Update(const Mesh *m);
 		#ifdef DISPLAY_MORPH_ENGINE
 			void Display(GraphicsWindow *gw) const;
 		#endif // DISPLAY_MORPH_ENGINE
@@ -133,18 +213,45 @@ private:
 	private:
 		Mesh *mesh;
 		float interpCoeff;
+		int lod;
 	public:
-		inline InterpolatedMesh(Mesh *m, float coeff):mesh(m),interpCoeff(coeff){}
-		inline InterpolatedMesh():mesh(NULL),interpCoeff(-1.f){}
-		inline InterpolatedMesh(const InterpolatedMesh &m):mesh(m.mesh),interpCoeff(m.interpCoeff){}
+		inline InterpolatedMesh(Mesh *m, float coeff, int lod):mesh(m),interpCoeff(coeff),lod(lod){}
+		inline InterpolatedMesh():mesh(NULL),interpCoeff(-1.f),lod(0){}
+		inline InterpolatedMesh(const InterpolatedMesh &m):mesh(m.mesh),interpCoeff(m.interpCoeff),lod(m.lod){}
 		inline ~InterpolatedMesh(){
 			if (mesh) delete mesh;
 		}
 	};
 	std::vector<InterpolatedMesh *> meshesCache;
 
+	// state of the coherent extraction of the in-between meshes: the distances at the vertices of the grid (they
+	// don't depend on the coefficient), the marching cubes case of the cells crossed by the previous mesh with
+	// its triangles as edges of the grid (3 per triangle), and the vertex of the previous mesh on each edge
+	struct CoherentCell{
+		int indexInMap;
+		std::vector<GridEdge> triangles;
+	};
+	bool bCoherent;
+	// the in-between meshes of GetResultMesh are polygonized by following their surface
+	bool bContinuation;
+	// the meshes of the ADF forests (remeshing, operands) are polygonized on the dual grid of the octrees
+	bool bDual;
+	// or with the dual contouring
+	bool bContouring;
+	std::map<LatticePoint, BlendSample> blendSamples;
+	std::map<LatticePoint, CoherentCell> coherentCells;
+	std::map<GridEdge, int> coherentVertices;
+	Mesh *coherentMesh;
+	int coherentLOD;
+	// level of detail of the current call to GetResultMesh/GetResultMeshes: number of the finest levels of the
+	// octrees and of the grid of the in-between meshes skipped by the extraction
+	int lod;
+
 	int version;
 	EMorphingType morphingMode;
+	ADFRefinement refinement;
+	std::vector<RegionOfInterest> regions;
+	ESymmetry symmetry;
 
 	RigidTransformation rigid;
 	ElasticTransformation elastic;
@@ -152,12 +259,22 @@ private:
 
 // ctor - dtor
 public:
-	explicit MorphEngine()
+	explicit MorphEngine() : refinement(ADF_RELATIVE_ERROR, ADF_MIN_ERROR, ADF_CURVATURE_WEIGHT)
 	{
 		version = MORPH3D_ENG_VERSION;
 		morphingMode = EMT_None;
+		refinement.budget = ADFBudget(ADF_MAX_CELLS, ADF_MAX_MEMORY, ADF_MAX_TIME);
+		refinement.proxy_ratio = ADF_PROXY_RATIO;
+		symmetry = ADF_SYMMETRY;
 		morph1 = NULL;
 		morph2 = NULL;
+		bCoherent = MC_COHERENT_EXTRACTION;
+		bContinuation = MC_CONTINUATION;
+		bDual = MC_DUAL_EXTRACTION;
+		bContouring = MC_DUAL_CONTOURING;
+		coherentMesh = NULL;
+		coherentLOD = 0;
+		lod = 0;
 		Init();
 	}
 	~MorphEngine(){
@@ -170,8 +287,7 @@ public:
 		elastic = ElasticTransformation();
 		morphingMode = EMT_None;
 		listOfAnchorPoints.clear();
-		for (std::vector<InterpolatedMesh *>::iterator it=meshesCache.begin();it!=meshesCache.end();++it)
-			delete (*it);
+		ClearMeshesCache();
 		morph1 = NULL;
 		morph2 = NULL;
 	}
@@ -180,20 +296,99 @@ public:
 // Member Functions
 private:
 	void ComputeInterpolatedMesh(Mesh *&m, float coeff_morphing_);
+	// polygonize the blends of the two operands for several coefficients in a single traversal
+	void ComputeInterpolatedMeshes(Mesh **meshes, const float *coeffs, int nbCoeffs);
+	// polygonize the blend by marching along its surface from seeds, the work follows the area of the surface
+	void ComputeContinuationMesh(Mesh *&m, float coeff_morphing);
+	// grid of 2^GetBlendDepth() cells covering both operands, on which the in-between meshes are extracted
+	void GetBlendGrid(Point3 &minBox, Point3 &step) const;
+	inline int GetBlendDepth() const{return max(0, MAX_DEPTH-lod);}
+	// Query at once the distances at the corners of some cells of the grid (of 'size' cells) missing from 'samples'
+	void SampleBlendCorners(const std::vector<LatticePoint> &cells, int size, const Point3 &minBox, const Point3 &step,
+							std::map<LatticePoint, BlendSample> &samples) const;
+	// Find the cells of the finest level of the grid (by min corner) the surface of one of the blends can cross,
+	// the distances at the corners of the cells are taken from 'samples', or queried and added to it
+	void GetBlendLeaves(const float *coeffs, int nbCoeffs, std::map<LatticePoint, BlendSample> &samples, std::vector<LatticePoint> &leaves) const;
+	// Get the in-between mesh from the one of the previous call, only the cells whose case changed are triangulated again
+	bool GetCoherentMesh(Mesh *&m, float coeff_morphing);
+	// Same as ComputeInterpolatedMeshes in the coherent mode: the triangles are only extracted at the coefficients
+	// where the topology changes, found by bisection, and shared with the following ones whose vertices are moved
+	void ComputeKeyframedMeshes(Mesh **meshes, const float *coeffs, int nbCoeffs);
 	// void ComputeMCInCell(ADFOctree::Cell *cell, const Box3 &curBbox, std::map<SplPoint3, int>&mapOfVertices, std::vector<SplFace> &listOfFaces) const;
-	void ComputeMesh(Mesh *&m, ADFOctree *octree);
+	// polygonize the octrees of an operand, the mesh is placed with the transform of the operand
+	void ComputeMesh(Mesh *&m, const MeshMorpher *morph);
+	// look for the mesh of a coefficient at the current level of detail
 	void FindMeshInCache(Mesh *&m, float coeff_morphing_) const;
+	void ClearMeshesCache();
 	void ComputeRigidTransformation();
 	void ComputeElasticTransformation();
 	bool GetMorphingMesh(Mesh *&m, float coeff_morphing);
+	// Get the velocity of the surface of the blend D(t) at the vertices of a mesh: it moves along the normal
+	// by -(dD/dt)/|grad D|, with dD/dt = D2-D1 taken from the fields of the two operands
+	void ComputeVelocities(const Mesh *m, float coeff_morphing, std::vector<Point3> &velocities) const;
 	bool GetTransformedMesh(Mesh *&m, float coeff_morphing, bool bApplyRigid, bool bApplyElastic);
 
 public:
 	Mesh *GetMesh1() const{return morph1 ? morph1->GetMesh() : NULL;}
 	Mesh *GetMesh2() const{return morph2 ? morph2->GetMesh() : NULL;}
-	void SetMesh1(Mesh *m, Box3 box);
-	void SetMesh2(Mesh *m, Box3 box);
-	bool GetResultMesh(Mesh *&m, float coeff_morphing_);
+	// 'm' is given in the local space of the operand, and 'tm' is the transform of the operand
+	void SetMesh1(Mesh *m, const Matrix3 &tm);
+	void SetMesh2(Mesh *m, const Matrix3 &tm);
+	// same as SetMesh1/SetMesh2 for an animated operand, only the parts of the octrees around the moved faces are rebuilt
+	// and a change of the transform alone doesn't rebuild anything
+	void UpdateMesh1(Mesh *m, const Matrix3 &tm);
+	void UpdateMesh2(Mesh *m, const Matrix3 &tm);
+	// If 'velocities' isn't NULL, it receives the velocity of each vertex of the mesh (in the morphing mode only,
+	// empty otherwise), in units of the space of the morphing per unit of coefficient: the motion vectors of a
+	// frame are these times the change of the coefficient between the frames.
+	// 'lod' is the number of the finest levels skipped by the extraction (0 for the full resolution): the cells
+	// deeper than that are replaced by their ancestor, so a cheap mesh for the viewports and the full one for the
+	// render come from the same octrees. The meshes of each level of detail are cached separately.
+	bool GetResultMesh(Mesh *&m, float coeff_morphing_, std::vector<Point3> *velocities=NULL, int lod=0);
+	// One-shot remeshing of a mesh through its distance field, with the refinement, regions of interest and symmetry
+	// of the engine: the leaves of the ADF are polygonized as soon as they are filled and the octree isn't kept.
+	// The returned mesh belongs to the caller.
+	Mesh *Remesh(Mesh *m) const;
+	// Same as GetResultMesh for a list of coefficients (the frames of a sequence...), the in-between meshes
+	// not in the cache are extracted together
+	bool GetResultMeshes(Mesh **meshes, const float *coeffs, int nbCoeffs, int lod=0);
+	// Get the level of detail of GetResultMesh whose cells cover about MC_PIXELS_PER_CELL pixels when the mesh
+	// covers 'pixels' pixels of the screen (its largest side)
+	int GetLODFromScreenSize(float pixels) const;
+	// In the coherent mode, the in-between mesh given by GetResultMesh keeps the faces and the order of the vertices
+	// of the previous call while the surface crosses the same edges of the grid, only its vertices are moved.
+	// The mesh isn't simplified, and it stays owned by the engine until the next call. GetResultMeshes gives the
+	// same unsimplified meshes, sharing their faces between the coefficients of a same topology.
+	bool GetCoherentExtraction() const{return bCoherent;}
+	void SetCoherentExtraction(bool bCoherent_){bCoherent = bCoherent_; ClearMeshesCache();}
+	// In the continuation mode, GetResultMesh polygonizes the in-between mesh by marching from cells of the surface
+	// to their neighbours, starting from the vertices of the operands: its cost follows the area of the surface
+	// instead of the volume, but the parts of the surface far from both operands may be missed
+	bool GetContinuationExtraction() const{return bContinuation;}
+	void SetContinuationExtraction(bool bContinuation_){bContinuation = bContinuation_; ClearMeshesCache();}
+	// In the dual mode, Remesh and the meshes of the operands are polygonized with the dual marching cubes: the
+	// surface is watertight where the leaves of the ADF change of level, and the large leaves give large triangles.
+	// The leaves aren't polygonized while the octree is filled then.
+	bool GetDualExtraction() const{return bDual;}
+	void SetDualExtraction(bool bDual_){bDual = bDual_; ClearMeshesCache();}
+	// The dual contouring (used instead of the other extractions when set) places one vertex per leaf crossed by
+	// the surface from the closest points and normals of the mesh: the sharp features are kept with large leaves,
+	// and the mesh has less triangles. A leaf crossed by several sheets of the surface gets a single vertex though.
+	bool GetDualContouring() const{return bContouring;}
+	void SetDualContouring(bool bContouring_){bContouring = bContouring_; ClearMeshesCache();}
+	// the refinement criterion is used by the next calls to SetMesh1/SetMesh2
+	const ADFRefinement &GetRefinement() const{return refinement;}
+	void SetRefinement(const ADFRefinement &refinement_){refinement = refinement_;}
+	// the regions of interest (in the space of the meshes) are also used by the next calls to SetMesh1/SetMesh2
+	void AddRegionOfInterest(const RegionOfInterest &region){regions.push_back(region);}
+	void ClearRegionsOfInterest(){regions.clear();}
+	// Get the region of interest bounding the vertices of a mesh whose weight (painted, soft selection...) is above a threshold
+	static bool GetRegionFromWeights(const Mesh &mesh, const float *weights, float threshold, int max_depth, float relative_error, RegionOfInterest &region);
+	// the symmetry is also used by the next calls to SetMesh1/SetMesh2
+	ESymmetry GetSymmetry() const{return symmetry;}
+	void SetSymmetry(ESymmetry symmetry_){symmetry = symmetry_;}
+	// Find an axis-aligned plane of symmetry through the center of the mesh (each vertex has a reflection within 'tolerance')
+	static bool DetectSymmetry(const Mesh &mesh, float tolerance, int &axis, float &plane);
 	void Clear(){
 		Free();
 		Init();
@@ -13,11 +13,31 @@
  *>	Copyright (c) 2006, All Rights Reserved.
  **********************************************************************/
 
+#pragma once
+
 #define	MAX_DEPTH_DEBUG		5					// Max depth in the octree
 #define	MAX_DEPTH_RELEASE	6					// Max depth in the octree
 #define USE_BOUNDING_BOXES_IN_FACEOCTREE	0	// Should we use the simplified test for triangles
 #define MIN_FACES_FOR_SUBDIVIDE		0			// Minimum number of triangles in a cell of the FaceOctree
-#define MIN_ERROR	1e-5						// Min error check when filling the ADFOctree
+#define ADF_RELATIVE_ERROR		0.01f		// Max interpolation error in a cell of the ADFOctree, relative to the cell diagonal
+#define ADF_MIN_ERROR			0.0005f		// Error below which a cell of the ADFOctree is never subdivided, relative to the object diagonal
+#define ADF_CURVATURE_WEIGHT	1.f			// How much the bending of the surface inside a cell tightens the error (0 to disable)
+#define ADF_PROXY_RATIO			0.25f		// Part of the tolerance of a cell its samples may lose by using a simplified mesh (0 to disable)
+#define ADF_PROXY_LEVELS		4			// Max number of simplified meshes used by the ADF at the coarse levels
+#define ADF_MAX_ROOTS			64			// Max number of cubic roots of the ADF forest tiling the box of a mesh (1 for a single cube)
+#define ADF_SYMMETRY			ES_None		// Symmetry of the meshes (ES_None, ES_X, ES_Y, ES_Z or ES_Auto)
+#define ADF_SYMMETRY_TOLERANCE	0.0001f		// Tolerance of the symmetry detection, relative to the object diagonal
+#define ADF_MAX_CELLS			0			// Budget of the ADFOctree refinement in cells (0 for no limit)
+#define ADF_MAX_MEMORY			0			// Budget of the ADFOctree refinement in MB (0 for no limit)
+#define ADF_MAX_TIME			0.f			// Budget of the ADFOctree refinement in seconds (0 for no limit)
+#define MC_COHERENT_EXTRACTION	false		// Keep the topology of the in-between mesh from one frame to the next when it doesn't change
+#define MC_CONTINUATION			false		// Polygonize the in-between mesh by following its surface from seeds
+#define MC_CONTINUATION_SEEDS	4096		// Max number of vertices of each operand used as seeds by the continuation
+#define MC_DUAL_EXTRACTION		false		// Polygonize the ADF forests with the dual marching cubes (no cracks between levels)
+#define MC_DUAL_CONTOURING		false		// Polygonize the ADF forests with the dual contouring (sharp features, less triangles)
+#define MC_PIXELS_PER_CELL		4.f			// Size on the screen of the cells of the extraction chosen from the view in the render
+#define MC_MIN_LOD_DEPTH		3			// Depth of the extraction below which the view doesn't coarsen the meshes
+#define DC_QEF_REGULARIZATION	0.05f		// Pull of the vertices of the dual contouring towards the mean of their Hermite points
 //#define _FOCTREE_USE_BOOLEAN_SAMEASPARENT
 #define DONT_DETECT_HOLES	1
 
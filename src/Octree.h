@@ -83,6 +83,21 @@ public:
 	}
 };
 
+// Region of the space refined deeper than the rest of an octree: the cells intersecting the box can go down
+// to max_depth, and the ADFOctree uses relative_error (if not null) as the tolerance of its refinement there
+struct RegionOfInterest{
+	Box3 box;
+	int max_depth;
+	float relative_error;
+	RegionOfInterest():max_depth(0),relative_error(0.f){}
+	RegionOfInterest(const Box3 &box, int max_depth, float relative_error):box(box),max_depth(max_depth),relative_error(relative_error){}
+	inline bool Intersects(const Box3 &b) const{
+		Point3 bmin = b.Min(), bmax = b.Max();
+		Point3 rmin = box.Min(), rmax = box.Max();
+		return (bmin.x<=rmax.x && bmax.x>=rmin.x && bmin.y<=rmax.y && bmax.y>=rmin.y && bmin.z<=rmax.z && bmax.z>=rmin.z);
+	}
+};
+
 #ifndef OPTIMIZATIONS_OCTREE
 #define SUBDIVIDE(x) x->Subdivide()
 #else
@@ -126,6 +141,10 @@ private:
 				for (int i=0;i<8;++i)
 					childs[i] = new Cell(this);
 			}
+			// remove the childs of the cell, which becomes a leaf
+			inline void Collapse(){
+				for (int i=0;i<8;++i) if (childs[i]) {delete (childs[i]); childs[i]=NULL;}
+			}
 #else
 			inline void InitChildPointers(Cell *childsPtr){
 				for (int i=0;i<8;++i){
@@ -149,14 +168,19 @@ private:
 	Cell root;
 	Box3 bbox;
 	int max_depth;
+	// depth of the cells outside of the regions of interest
+	int base_depth;
+	std::vector<RegionOfInterest> regions;
 	#ifdef OPTIMIZATIONS_OCTREE
 		int cpt_cells, size;
 		Cell *arrayOfCells;
+		// blocks of 8 childs given back by CollapseCell, reused before the array
+		std::vector<Cell *> freeBlocks;
 	#endif //OPTIMIZATIONS_OCTREE
 
 // Ctor
 public:
-	Octree(const Box3 &bbox, int max_depth) : root(), bbox(bbox), max_depth(max_depth){
+	Octree(const Box3 &bbox, int max_depth) : root(), bbox(bbox), max_depth(max_depth), base_depth(max_depth){
 #ifdef OPTIMIZATIONS_OCTREE
 			cpt_cells = 0;
 			size = OPT_OCTREE_ARRAY_SIZE;
@@ -174,9 +198,15 @@ private:
 	virtual void Reset(T value) = 0;
 	void Destroy(){
 		for (int i=0;i<8;++i) if (root.childs[i]) {delete root.childs[i]; root.childs[i]=NULL;}
+		OPT_OCTREE(freeBlocks.clear();)
 	}
 #ifdef OPTIMIZATIONS_OCTREE
 	inline Cell *NextCellPtr(){
+		if (!freeBlocks.empty()){
+			Cell *block = freeBlocks.back();
+			freeBlocks.pop_back();
+			return block;
+		}
 		if ((8*cpt_cells)==size){
 			arrayOfCells = new Cell[size]; // will be deleted by the cells themselves
 			cpt_cells = 0;
@@ -184,6 +214,23 @@ private:
 		return arrayOfCells+(8*cpt_cells++);
 	}
 #endif
+	// Remove the childs of a cell, which becomes a leaf
+	void CollapseCell(Cell *cell){
+#ifndef OPTIMIZATIONS_OCTREE
+		cell->Collapse();
+#else
+		// the childs can't be deleted from their array, their block is given back to NextCellPtr
+		Cell *block = cell->childs[0];
+		if (!block)
+			return;
+		for (int i=0;i<8;++i){
+			CollapseCell(block+i);
+			block[i].value = T();
+			cell->childs[i] = NULL;
+		}
+		freeBlocks.push_back(block);
+#endif
+	}
 
 public:
 	void Clear(){
@@ -201,6 +248,21 @@ public:
 		return current;
 	}
 	inline int GetMaxDepth() const{return max_depth;}
+	inline const Box3 &GetBBox() const{return bbox;}
+	// Set the regions of interest, the cells outside of all of them stop at base_depth (<= max_depth)
+	void SetRegionsOfInterest(const std::vector<RegionOfInterest> &regions_, int base_depth_){
+		regions = regions_;
+		base_depth = min(base_depth_, max_depth);
+	}
+	// Get the maximum depth of a cell: the deepest of the base depth and of the regions intersecting the cell
+	inline int GetCellMaxDepth(const Box3 &cellBox) const{
+		int depth = base_depth;
+		for (std::vector<RegionOfInterest>::const_iterator it=regions.begin(); it!=regions.end(); ++it){
+			if (it->Intersects(cellBox))
+				depth = max(depth, it->max_depth);
+		}
+		return min(depth, max_depth);
+	}
 	#ifdef DISPLAY_MORPH_ENGINE
 		void DisplayCell(GraphicsWindow *gw, const Cell *cell, const Box3 &b) const
 		{